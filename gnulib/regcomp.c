@@ -27,12 +27,22 @@ static reg_errcode_t init_dfa (re_dfa_t *dfa, size_t pat_len);
 #ifdef RE_ENABLE_I18N
 static void free_charset (re_charset_t *cset);
 #endif /* RE_ENABLE_I18N */
-static void free_workarea_compile (regex_t *preg);
+static void free_workarea_compile (re_dfa_t *dfa);
 static reg_errcode_t create_initial_state (re_dfa_t *dfa);
+static reg_errcode_t create_reverse_dfa (re_dfa_t *dfa);
+static reg_errcode_t create_shift_and (regex_t *preg);
+static reg_errcode_t add_shift_and_node (void *extra, bin_tree_t *node);
+static bool item_accepts_p (const re_dfa_t *dfa, const bin_tree_t *node,
+			    int ch);
+static reg_errcode_t create_class_run (regex_t *preg);
+/* Defined in regexec.c.  */
+static reg_errcode_t create_flat_dfa (re_dfa_t *dfa, Idx max_states);
+static reg_errcode_t create_literals (re_dfa_t *dfa);
 #ifdef RE_ENABLE_I18N
 static void optimize_utf8 (re_dfa_t *dfa);
 #endif
 static reg_errcode_t analyze (regex_t *preg);
+static reg_errcode_t build_nfa (re_dfa_t *dfa);
 static reg_errcode_t preorder (bin_tree_t *root,
 			       reg_errcode_t (fn (void *, bin_tree_t *)),
 			       void *extra);
@@ -40,6 +50,13 @@ static reg_errcode_t postorder (bin_tree_t *root,
 				reg_errcode_t (fn (void *, bin_tree_t *)),
 				void *extra);
 static reg_errcode_t optimize_subexps (void *extra, bin_tree_t *node);
+static bin_tree_t *optimize_alt (re_dfa_t *dfa, bin_tree_t *tree,
+				 reg_errcode_t *err);
+static reg_errcode_t count_line_last (void *extra, bin_tree_t *node);
+static void optimize_dot_star (re_dfa_t *dfa);
+static reg_errcode_t lower_utf8 (void *extra, bin_tree_t *node);
+static bool case_fold_simple_p (void);
+static reg_errcode_t fold_case (void *extra, bin_tree_t *node);
 static reg_errcode_t lower_subexps (void *extra, bin_tree_t *node);
 static bin_tree_t *lower_subexp (reg_errcode_t *err, regex_t *preg,
 				 bin_tree_t *node);
@@ -117,9 +134,12 @@ static bin_tree_t *create_token_tree (re_dfa_t *dfa,
 				      bin_tree_t *left, bin_tree_t *right,
 				      const re_token_t *token);
 static bin_tree_t *duplicate_tree (const bin_tree_t *src, re_dfa_t *dfa);
+static bin_tree_t *reverse_tree (const bin_tree_t *root, re_dfa_t *dfa,
+				 reg_errcode_t *err);
 static void free_token (re_token_t *node);
 static reg_errcode_t free_tree (void *extra, bin_tree_t *node);
 static reg_errcode_t mark_opt_subexp (void *extra, bin_tree_t *node);
+static bool has_subexp_p (const bin_tree_t *root);
 
 /* This table gives an error message for each of the error codes listed
    in regex.h.  Obviously the order here has to be same as there.
@@ -178,6 +198,9 @@ static const char __re_error_msgid[] =
     "\0"
 #define REG_ERPAREN_IDX	(REG_ESIZE_IDX + sizeof "Regular expression too big")
     gettext_noop ("Unmatched ) or \\)") /* REG_ERPAREN */
+    "\0"
+#define REG_ELIMIT_IDX	(REG_ERPAREN_IDX + sizeof "Unmatched ) or \\)")
+    gettext_noop ("Match step limit exceeded") /* REG_ELIMIT */
   };
 
 static const size_t __re_error_msgid_idx[] =
@@ -198,7 +221,8 @@ static const size_t __re_error_msgid_idx[] =
     REG_BADRPT_IDX,
     REG_EEND_IDX,
     REG_ESIZE_IDX,
-    REG_ERPAREN_IDX
+    REG_ERPAREN_IDX,
+    REG_ELIMIT_IDX
   };
 
 /* Entry points for GNU code.  */
@@ -276,6 +300,7 @@ re_compile_fastmap (bufp)
 {
   re_dfa_t *dfa = (re_dfa_t *) bufp->buffer;
   char *fastmap = bufp->fastmap;
+  int ch;
 
   memset (fastmap, '\0', sizeof (char) * SBC_MAX);
   re_compile_fastmap_iter (bufp, dfa->init_state, fastmap);
@@ -285,6 +310,20 @@ re_compile_fastmap (bufp)
     re_compile_fastmap_iter (bufp, dfa->init_state_nl, fastmap);
   if (dfa->init_state != dfa->init_state_begbuf)
     re_compile_fastmap_iter (bufp, dfa->init_state_begbuf, fastmap);
+
+  /* Remember the bytes of a sparse fastmap, so that the search can look
+     for them several at a time.  */
+  dfa->fastmap_nbytes = 0;
+  for (ch = 0; ch < SBC_MAX; ++ch)
+    if (fastmap[ch])
+      {
+	if (dfa->fastmap_nbytes == FASTMAP_BYTES_MAX)
+	  {
+	    dfa->fastmap_nbytes = 0;
+	    break;
+	  }
+	dfa->fastmap_bytes[dfa->fastmap_nbytes++] = ch;
+      }
   bufp->fastmap_accurate = 1;
   return 0;
 }
@@ -511,12 +550,8 @@ regcomp (preg, pattern, cflags)
   if (ret == REG_ERPAREN)
     ret = REG_EPAREN;
 
-  /* We have already checked preg->fastmap != NULL.  */
-  if (BE (ret == REG_NOERROR, 1))
-    /* Compute the fastmap now, since regexec cannot modify the pattern
-       buffer.  This function never fails in this implementation.  */
-    (void) re_compile_fastmap (preg);
-  else
+  /* re_compile_internal has already computed the fastmap.  */
+  if (BE (ret != REG_NOERROR, 0))
     {
       /* Some error occurred while compiling the expression.  */
       re_free (preg->fastmap);
@@ -639,15 +674,34 @@ free_dfa_content (re_dfa_t *dfa)
         re_free (entry->array);
       }
   re_free (dfa->state_table);
+  for (i = 0; i < dfa->nretired; ++i)
+    re_free (dfa->retired[i]);
+  re_free (dfa->retired);
 #ifdef RE_ENABLE_I18N
   if (dfa->sb_char != utf8_sb_map)
     re_free (dfa->sb_char);
 #endif
   re_free (dfa->subexp_map);
+  if (dfa->rev_dfa != NULL)
+    free_dfa_content (dfa->rev_dfa);
+  re_free (dfa->flat_trans);
+  if (dfa->shift_and != NULL)
+    {
+      re_free (dfa->shift_and->offsets);
+      re_free (dfa->shift_and);
+    }
+  re_free (dfa->class_run);
+  if (dfa->literals != NULL)
+    {
+      re_free (dfa->literals->trans);
+      re_free (dfa->literals->out);
+      re_free (dfa->literals);
+    }
 #ifdef DEBUG
   re_free (dfa->re_str);
 #endif
 
+  lock_fini (dfa->lock);
   re_free (dfa);
 }
 
@@ -794,14 +848,12 @@ re_compile_internal (regex_t *preg, const char * pattern, size_t length,
   strncpy (dfa->re_str, pattern, length + 1);
 #endif
 
-  __libc_lock_init (dfa->lock);
-
   err = re_string_construct (&regexp, pattern, length, preg->translate,
 			     (syntax & RE_ICASE) != 0, dfa);
   if (BE (err != REG_NOERROR, 0))
     {
     re_compile_internal_free_return:
-      free_workarea_compile (preg);
+      free_workarea_compile (dfa);
       re_string_destruct (&regexp);
       free_dfa_content (dfa);
       preg->buffer = NULL;
@@ -828,9 +880,22 @@ re_compile_internal (regex_t *preg, const char * pattern, size_t length,
 
   /* Then create the initial state of the dfa.  */
   err = create_initial_state (dfa);
+  if (BE (err == REG_NOERROR, 1))
+    err = create_reverse_dfa (dfa);
+  if (BE (err == REG_NOERROR, 1))
+    err = create_shift_and (preg);
+  if (BE (err == REG_NOERROR, 1) && dfa->shift_and == NULL)
+    err = create_class_run (preg);
+  if (BE (err == REG_NOERROR, 1) && dfa->shift_and == NULL
+      && dfa->class_run == NULL)
+    err = create_flat_dfa (dfa, FLAT_DFA_STATES_MAX);
+  if (BE (err == REG_NOERROR, 1) && dfa->shift_and == NULL
+      && dfa->class_run == NULL
+      && preg->translate == NULL && !(preg->syntax & RE_ICASE))
+    err = create_literals (dfa);
 
   /* Release work areas.  */
-  free_workarea_compile (preg);
+  free_workarea_compile (dfa);
   re_string_destruct (&regexp);
 
   if (BE (err != REG_NOERROR, 0))
@@ -839,6 +904,10 @@ re_compile_internal (regex_t *preg, const char * pattern, size_t length,
       preg->buffer = NULL;
       preg->allocated = 0;
     }
+  else if (preg->fastmap != NULL)
+    /* Compute the fastmap before the pattern can be shared, so that
+       searches never write to the pattern buffer.  */
+    re_compile_fastmap (preg);
 
   return err;
 }
@@ -863,6 +932,7 @@ init_dfa (re_dfa_t *dfa, size_t pat_len)
 			max_i18n_object_size))));
 
   memset (dfa, '\0', sizeof (re_dfa_t));
+  lock_init (dfa->lock);
 
   /* Force allocation of str_tree_storage the first time.  */
   dfa->str_tree_storage_idx = BIN_TREE_STORAGE_SIZE;
@@ -885,7 +955,13 @@ init_dfa (re_dfa_t *dfa, size_t pat_len)
   dfa->state_table = calloc (sizeof (struct re_state_table_entry), table_size);
   dfa->state_hash_mask = table_size - 1;
 
+#ifdef RE_ENABLE_I18N
   dfa->mb_cur_max = MB_CUR_MAX;
+#else
+  /* Without multibyte support the matcher works on bytes anyway, so
+     always take the single byte paths; see lower_utf8.  */
+  dfa->mb_cur_max = 1;
+#endif
 #ifdef _LIBC
   if (dfa->mb_cur_max == 6
       && strcmp (_NL_CURRENT (LC_CTYPE, _NL_CTYPE_CODESET_NAME), "UTF-8") == 0)
@@ -954,9 +1030,8 @@ init_word_char (re_dfa_t *dfa)
 /* Free the work area which are only used while compiling.  */
 
 static void
-free_workarea_compile (regex_t *preg)
+free_workarea_compile (re_dfa_t *dfa)
 {
-  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
   bin_tree_storage_t *storage, *next;
   for (storage = dfa->str_tree_storage; storage; storage = next)
     {
@@ -1048,6 +1123,332 @@ create_initial_state (re_dfa_t *dfa)
   re_node_set_free (&init_nodes);
   return REG_NOERROR;
 }
+
+/* Return a copy of the tree ROOT that matches the reversed strings,
+   allocated in DFA.  Return NULL and set *ERR to REG_NOMATCH if ROOT
+   contains a node that cannot be reversed, or to REG_ESPACE if we run
+   out of memory.  Like duplicate_tree, walk the tree without recursion;
+   the tokens are shared with ROOT.  */
+
+static bin_tree_t *
+reverse_tree (const bin_tree_t *root, re_dfa_t *dfa, reg_errcode_t *err)
+{
+  const bin_tree_t *node;
+  bin_tree_t *rev_root, *rev_node = NULL;
+  bin_tree_t **p_new = &rev_root;
+
+  for (node = root; ; )
+    {
+      switch (node->token.type)
+	{
+	case CHARACTER:
+	case SIMPLE_BRACKET:
+	case OP_PERIOD:
+	case CONCAT:
+	case OP_ALT:
+	case OP_DUP_ASTERISK:
+	case OP_OPEN_SUBEXP:
+	case OP_CLOSE_SUBEXP:
+	  break;
+	default:
+	  *err = REG_NOMATCH;
+	  return NULL;
+	}
+
+      *p_new = create_token_tree (dfa, NULL, NULL, &node->token);
+      if (BE (*p_new == NULL, 0))
+	{
+	  *err = REG_ESPACE;
+	  return NULL;
+	}
+      (*p_new)->parent = rev_node;
+      (*p_new)->token.duplicated = 1;
+      rev_node = *p_new;
+
+      /* The operands of a concatenation trade places.  */
+      if (node->left)
+	{
+	  node = node->left;
+	  p_new = (rev_node->token.type == CONCAT
+		   ? &rev_node->right : &rev_node->left);
+	}
+      else
+	{
+	  const bin_tree_t *prev = NULL;
+	  while (node->right == prev || node->right == NULL)
+	    {
+	      if (node == root)
+		return rev_root;
+	      prev = node;
+	      node = node->parent;
+	      rev_node = rev_node->parent;
+	    }
+	  node = node->right;
+	  p_new = (rev_node->token.type == CONCAT
+		   ? &rev_node->left : &rev_node->right);
+	}
+    }
+}
+
+/* If the pattern is of the form `<re>$' and <re> can be reversed, build
+   the automaton of the reversed <re> in DFA->REV_DFA.  */
+
+static reg_errcode_t
+create_reverse_dfa (re_dfa_t *dfa)
+{
+  bin_tree_t *body = dfa->str_tree->left, *tree, *eor;
+  re_dfa_t *rdfa;
+  reg_errcode_t err;
+
+#ifdef RE_ENABLE_I18N
+  if (dfa->mb_cur_max > 1)
+    return REG_NOERROR;
+#endif
+  if (dfa->nbackref > 0 || body == NULL || body->token.type != CONCAT
+      || body->right->token.type != ANCHOR
+      || body->right->token.opr.ctx_type != LINE_LAST)
+    return REG_NOERROR;
+
+  rdfa = re_malloc (re_dfa_t, 1);
+  if (BE (rdfa == NULL, 0))
+    return REG_ESPACE;
+  err = init_dfa (rdfa, dfa->nodes_len);
+  if (BE (err != REG_NOERROR, 0))
+    goto free_return;
+  rdfa->syntax = dfa->syntax;
+
+  tree = reverse_tree (body->left, rdfa, &err);
+  if (tree == NULL)
+    goto free_return;
+  eor = create_tree (rdfa, NULL, NULL, END_OF_RE);
+  rdfa->str_tree = eor ? create_tree (rdfa, tree, eor, CONCAT) : NULL;
+  if (BE (rdfa->str_tree == NULL, 0))
+    {
+      err = REG_ESPACE;
+      goto free_return;
+    }
+
+  err = build_nfa (rdfa);
+  if (BE (err == REG_NOERROR, 1))
+    err = create_initial_state (rdfa);
+  if (BE (err != REG_NOERROR, 0))
+    goto free_return;
+  free_workarea_compile (rdfa);
+  dfa->rev_dfa = rdfa;
+  return REG_NOERROR;
+
+ free_return:
+  free_workarea_compile (rdfa);
+  free_dfa_content (rdfa);
+  /* A pattern that cannot be reversed is simply searched forward.  */
+  return err == REG_NOMATCH ? REG_NOERROR : err;
+}
+
+/* Helper function for create_shift_and: add NODE to DFA->SHIFT_AND, or
+   return REG_NOMATCH if it cannot be added.  */
+
+static reg_errcode_t
+add_shift_and_node (void *extra, bin_tree_t *node)
+{
+  re_dfa_t *dfa = (re_dfa_t *) extra;
+  re_shift_and_t *sa = dfa->shift_and;
+  int ch;
+
+  switch (node->token.type)
+    {
+    case CONCAT:
+    case END_OF_RE:
+      return REG_NOERROR;
+    case OP_OPEN_SUBEXP:
+      sa->offsets[2 * node->token.opr.idx] = sa->len;
+      return REG_NOERROR;
+    case OP_CLOSE_SUBEXP:
+      sa->offsets[2 * node->token.opr.idx + 1] = sa->len;
+      return REG_NOERROR;
+    case CHARACTER:
+    case SIMPLE_BRACKET:
+    case OP_PERIOD:
+      break;
+    default:
+      return REG_NOMATCH;
+    }
+
+  if (sa->len == 64)
+    return REG_NOMATCH;
+  for (ch = 0; ch < SBC_MAX; ++ch)
+    if (item_accepts_p (dfa, node, ch))
+      sa->masks[ch] |= (uint64_t) 1 << sa->len;
+  ++sa->len;
+  return REG_NOERROR;
+}
+
+/* Return true if NODE, a character, bracket or period, accepts CH.  */
+
+static bool
+item_accepts_p (const re_dfa_t *dfa, const bin_tree_t *node, int ch)
+{
+  if (node->token.type == CHARACTER)
+    return node->token.opr.c == ch;
+  else if (node->token.type == SIMPLE_BRACKET)
+    return bitset_contain (node->token.opr.sbcset, ch);
+  else
+    return !((ch == '\n' && !(dfa->syntax & RE_DOT_NEWLINE))
+	     || (ch == '\0' && (dfa->syntax & RE_DOT_NOT_NULL)));
+}
+
+/* If the pattern is a sequence of at most 64 characters, brackets and
+   periods, possibly grouped in subexpressions, build a bit-parallel
+   matcher for it in DFA->SHIFT_AND.  Since every match has the same
+   length, the first one it finds is the leftmost-longest one, and the
+   subexpressions are at fixed offsets from its start.  */
+
+static reg_errcode_t
+create_shift_and (regex_t *preg)
+{
+  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  re_shift_and_t *sa;
+  reg_errcode_t err;
+  Idx i;
+
+  if (dfa->mb_cur_max > 1 || dfa->nbackref > 0)
+    return REG_NOERROR;
+
+  sa = (re_shift_and_t *) calloc (sizeof (re_shift_and_t), 1);
+  if (BE (sa == NULL, 0))
+    return REG_ESPACE;
+  sa->offsets = re_malloc (regoff_t, 2 * preg->re_nsub + 1);
+  if (BE (sa->offsets == NULL, 0))
+    {
+      re_free (sa);
+      return REG_ESPACE;
+    }
+  for (i = 0; i < 2 * preg->re_nsub; ++i)
+    sa->offsets[i] = -1;
+
+  dfa->shift_and = sa;
+  err = preorder (dfa->str_tree, add_shift_and_node, dfa);
+  if (err != REG_NOERROR || sa->len == 0)
+    {
+      re_free (sa->offsets);
+      re_free (sa);
+      dfa->shift_and = NULL;
+    }
+  return REG_NOERROR;
+}
+
+/* Return true if NODE is a character, bracket or period.  */
+
+static inline bool
+class_item_p (const bin_tree_t *node)
+{
+  return (node != NULL
+	  && (node->token.type == CHARACTER
+	      || node->token.type == SIMPLE_BRACKET
+	      || node->token.type == OP_PERIOD));
+}
+
+/* If the pattern is a character, bracket or period repeated with `*'
+   or `+' (which the parser turns into `XX*'), possibly preceded by `^'
+   and followed by `$', build in DFA->CLASS_RUN the set of bytes it
+   repeats.  A match is then a run of such bytes, which is found
+   without going through the DFA at all.  */
+
+static reg_errcode_t
+create_class_run (regex_t *preg)
+{
+  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  bin_tree_t *items[5], *stack[5], *node, *item;
+  re_class_run_t *cr;
+  Idx nitems = 0, depth = 0, i = 0;
+  bool bol = false, eol = false, nonempty = false;
+  int ch;
+
+  if (dfa->mb_cur_max > 1 || dfa->nbackref > 0 || preg->re_nsub > 0)
+    return REG_NOERROR;
+
+  /* List the operands of the concatenations from left to right.  */
+  for (node = dfa->str_tree; ; )
+    {
+      if (node == NULL)
+	return REG_NOERROR;
+      if (node->token.type == CONCAT)
+	{
+	  if (depth == sizeof (stack) / sizeof (stack[0]))
+	    return REG_NOERROR;
+	  stack[depth++] = node->right;
+	  node = node->left;
+	  continue;
+	}
+      if (nitems == sizeof (items) / sizeof (items[0]))
+	return REG_NOERROR;
+      items[nitems++] = node;
+      if (depth == 0)
+	break;
+      node = stack[--depth];
+    }
+
+  if (items[i]->token.type == ANCHOR
+      && items[i]->token.opr.ctx_type == LINE_FIRST)
+    {
+      bol = true;
+      ++i;
+    }
+  if (i < nitems && items[i]->token.type == OP_DUP_ASTERISK
+      && class_item_p (items[i]->left) && items[i]->right == NULL)
+    item = items[i++]->left;
+  else if (i + 1 < nitems && class_item_p (items[i])
+	   && items[i + 1]->token.type == OP_DUP_ASTERISK
+	   && class_item_p (items[i + 1]->left)
+	   && items[i + 1]->right == NULL)
+    {
+      item = items[i];
+      for (ch = 0; ch < SBC_MAX; ++ch)
+	if (item_accepts_p (dfa, item, ch)
+	    != item_accepts_p (dfa, items[i + 1]->left, ch))
+	  return REG_NOERROR;
+      nonempty = true;
+      i += 2;
+    }
+  else
+    return REG_NOERROR;
+  if (i < nitems && items[i]->token.type == ANCHOR
+      && items[i]->token.opr.ctx_type == LINE_LAST)
+    {
+      eol = true;
+      ++i;
+    }
+  if (i + 1 != nitems || items[i]->token.type != END_OF_RE)
+    return REG_NOERROR;
+
+  cr = (re_class_run_t *) calloc (sizeof (re_class_run_t), 1);
+  if (BE (cr == NULL, 0))
+    return REG_ESPACE;
+  for (ch = 0; ch < SBC_MAX; ++ch)
+    {
+      cr->member[ch] = item_accepts_p (dfa, item, ch);
+      if (cr->member[ch] && cr->nmembers <= FASTMAP_BYTES_MAX)
+	{
+	  if (cr->nmembers < FASTMAP_BYTES_MAX)
+	    cr->members[cr->nmembers] = ch;
+	  ++cr->nmembers;
+	}
+      if (!cr->member[ch] && cr->nothers <= FASTMAP_BYTES_MAX)
+	{
+	  if (cr->nothers < FASTMAP_BYTES_MAX)
+	    cr->others[cr->nothers] = ch;
+	  ++cr->nothers;
+	}
+    }
+  if (cr->nmembers > FASTMAP_BYTES_MAX)
+    cr->nmembers = 0;
+  if (cr->nothers > FASTMAP_BYTES_MAX)
+    cr->nothers = 0;
+  cr->nonempty = nonempty;
+  cr->bol = bol;
+  cr->eol = eol;
+  dfa->class_run = cr;
+  return REG_NOERROR;
+}
 
 #ifdef RE_ENABLE_I18N
 /* If it is possible to do searching in single byte encoding instead of UTF-8
@@ -1140,14 +1541,26 @@ analyze (regex_t *preg)
   re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
   reg_errcode_t ret;
 
-  /* Allocate arrays.  */
-  dfa->nexts = re_malloc (Idx, dfa->nodes_alloc);
-  dfa->org_indices = re_malloc (Idx, dfa->nodes_alloc);
-  dfa->edests = re_malloc (re_node_set, dfa->nodes_alloc);
-  dfa->eclosures = re_malloc (re_node_set, dfa->nodes_alloc);
-  if (BE (dfa->nexts == NULL || dfa->org_indices == NULL || dfa->edests == NULL
-	  || dfa->eclosures == NULL, 0))
-    return REG_ESPACE;
+  optimize_dot_star (dfa);
+
+  if (dfa->is_utf8 && dfa->mb_cur_max == 1)
+    {
+      ret = postorder (dfa->str_tree, lower_utf8, dfa);
+      if (BE (ret != REG_NOERROR, 0))
+	return ret;
+    }
+
+  /* Match case-insensitive patterns on the input as is, rather than on
+     an upper-cased copy of it.  Back references compare the copy.  */
+  if ((dfa->syntax & RE_ICASE) && preg->translate == NULL
+      && dfa->nbackref == 0 && dfa->mb_cur_max == 1 && case_fold_simple_p ())
+    {
+      ret = preorder (dfa->str_tree, fold_case, dfa);
+      if (BE (ret != REG_NOERROR, 0))
+	return ret;
+      dfa->syntax &= ~RE_ICASE;
+      preg->syntax &= ~RE_ICASE;
+    }
 
   dfa->subexp_map = re_malloc (Idx, preg->re_nsub);
   if (dfa->subexp_map != NULL)
@@ -1169,14 +1582,7 @@ analyze (regex_t *preg)
   ret = postorder (dfa->str_tree, lower_subexps, preg);
   if (BE (ret != REG_NOERROR, 0))
     return ret;
-  ret = postorder (dfa->str_tree, calc_first, dfa);
-  if (BE (ret != REG_NOERROR, 0))
-    return ret;
-  preorder (dfa->str_tree, calc_next, dfa);
-  ret = preorder (dfa->str_tree, link_nfa_nodes, dfa);
-  if (BE (ret != REG_NOERROR, 0))
-    return ret;
-  ret = calc_eclosure (dfa);
+  ret = build_nfa (dfa);
   if (BE (ret != REG_NOERROR, 0))
     return ret;
 
@@ -1194,6 +1600,33 @@ analyze (regex_t *preg)
   return ret;
 }
 
+/* Create the NFA nodes of DFA->STR_TREE, which must not contain SUBEXP
+   nodes any more, and compute their transitions and epsilon closures.  */
+
+static reg_errcode_t
+build_nfa (re_dfa_t *dfa)
+{
+  reg_errcode_t ret;
+
+  /* Allocate arrays.  */
+  dfa->nexts = re_malloc (Idx, dfa->nodes_alloc);
+  dfa->org_indices = re_malloc (Idx, dfa->nodes_alloc);
+  dfa->edests = re_malloc (re_node_set, dfa->nodes_alloc);
+  dfa->eclosures = re_malloc (re_node_set, dfa->nodes_alloc);
+  if (BE (dfa->nexts == NULL || dfa->org_indices == NULL || dfa->edests == NULL
+	  || dfa->eclosures == NULL, 0))
+    return REG_ESPACE;
+
+  ret = postorder (dfa->str_tree, calc_first, dfa);
+  if (BE (ret != REG_NOERROR, 0))
+    return ret;
+  preorder (dfa->str_tree, calc_next, dfa);
+  ret = preorder (dfa->str_tree, link_nfa_nodes, dfa);
+  if (BE (ret != REG_NOERROR, 0))
+    return ret;
+  return calc_eclosure (dfa);
+}
+
 /* Our parse trees are very unbalanced, so we cannot use a stack to
    implement parse tree visits.  Instead, we use parent pointers and
    some hairy code in these two functions.  */
@@ -1291,6 +1724,314 @@ optimize_subexps (void *extra, bin_tree_t *node)
   return REG_NOERROR;
 }
 
+/* Return true if NODE is a leaf matching exactly one byte, that can be
+   merged into a SIMPLE_BRACKET.  */
+static bool
+single_byte_leaf_p (const re_dfa_t *dfa, const bin_tree_t *node)
+{
+  if (node == NULL || node->left != NULL || node->right != NULL)
+    return false;
+  if (node->token.type == SIMPLE_BRACKET)
+    return !node->token.duplicated;
+  if (node->token.type != CHARACTER)
+    return false;
+#ifdef RE_ENABLE_I18N
+  if (dfa->mb_cur_max > 1
+      && (node->token.mb_partial || !isascii (node->token.opr.c)))
+    return false;
+#endif
+  return true;
+}
+
+/* Optimization pass: turn an alternation of single byte branches, like
+   \(a\|b\|[cd]\), into one SIMPLE_BRACKET, which gives the automaton one
+   node instead of one per branch plus the OP_ALT nodes.  This is called
+   by parse_reg_exp for each new OP_ALT, so that longer alternations fold
+   from the left; at that point no bracket has been shared yet by
+   duplicate_tree, so the bitsets of the merged branches can be freed.
+   Return TREE itself if it cannot be folded.  */
+static bin_tree_t *
+optimize_alt (re_dfa_t *dfa, bin_tree_t *tree, reg_errcode_t *err)
+{
+  bin_tree_t *left = tree->left, *right = tree->right, *merged;
+  re_token_t br_token;
+
+  if (!single_byte_leaf_p (dfa, left) || !single_byte_leaf_p (dfa, right))
+    return tree;
+
+  if (left->token.type == SIMPLE_BRACKET)
+    merged = left;
+  else if (right->token.type == SIMPLE_BRACKET)
+    merged = right;
+  else
+    {
+      br_token.type = SIMPLE_BRACKET;
+      br_token.opr.sbcset = (re_bitset_ptr_t) calloc (sizeof (bitset_t), 1);
+      if (BE (br_token.opr.sbcset == NULL, 0))
+	{
+	  *err = REG_ESPACE;
+	  return NULL;
+	}
+      merged = create_token_tree (dfa, NULL, NULL, &br_token);
+      if (BE (merged == NULL, 0))
+	{
+	  re_free (br_token.opr.sbcset);
+	  *err = REG_ESPACE;
+	  return NULL;
+	}
+    }
+
+  if (left != merged)
+    {
+      if (left->token.type == CHARACTER)
+	bitset_set (merged->token.opr.sbcset, left->token.opr.c);
+      else
+	bitset_merge (merged->token.opr.sbcset, left->token.opr.sbcset);
+      free_token (&left->token);
+    }
+  if (right != merged)
+    {
+      if (right->token.type == CHARACTER)
+	bitset_set (merged->token.opr.sbcset, right->token.opr.c);
+      else
+	bitset_merge (merged->token.opr.sbcset, right->token.opr.sbcset);
+      free_token (&right->token);
+    }
+
+  merged->parent = NULL;
+  return merged;
+}
+
+/* Return true if NODE is `.*' where the period matches every byte.  */
+static bool
+any_star_p (const re_dfa_t *dfa, const bin_tree_t *node)
+{
+  return (node != NULL
+	  && node->token.type == OP_DUP_ASTERISK
+	  && node->left != NULL
+	  && node->left->token.type == OP_PERIOD
+	  && (dfa->syntax & RE_DOT_NEWLINE)
+	  && !(dfa->syntax & RE_DOT_NOT_NULL));
+}
+
+/* Count in *EXTRA the `$' anchors of the tree.  */
+static reg_errcode_t
+count_line_last (void *extra, bin_tree_t *node)
+{
+  if (node->token.type == ANCHOR && node->token.opr.ctx_type == LINE_LAST)
+    ++*(int *) extra;
+  return REG_NOERROR;
+}
+
+/* Optimization pass: look for a `.*' at the very beginning or at the very
+   end of the pattern.  A leading one can absorb any prefix, so a match
+   starting anywhere implies one at the first position tried and
+   re_search_internal need not try the others; this does not hold with
+   back references, which may match different text from a later start.
+   A trailing one (possibly followed by `$') makes the longest match
+   extend to the end of the input, so check_matching can stop scanning
+   at the first match.  Only concatenations and subexpressions are
+   looked through.  */
+static void
+optimize_dot_star (re_dfa_t *dfa)
+{
+  bin_tree_t *node, *body = dfa->str_tree->left;
+  int nline_last = 0;
+
+#ifdef RE_ENABLE_I18N
+  /* A multibyte period does not match invalid sequences.  */
+  if (dfa->mb_cur_max > 1)
+    return;
+#endif
+  if (dfa->str_tree->token.type != CONCAT || body == NULL)
+    return;
+
+  for (node = body; node != NULL; node = node->left)
+    if (node->token.type != CONCAT && node->token.type != SUBEXP)
+      break;
+  dfa->leading_dot_star = dfa->nbackref == 0 && any_star_p (dfa, node);
+
+  node = body;
+  if (node->token.type == CONCAT && node->right != NULL
+      && node->right->token.type == ANCHOR
+      && node->right->token.opr.ctx_type == LINE_LAST)
+    {
+      /* trailing_dot_star_halt recognizes the final `$' by the
+	 constraint it puts on END_OF_RE, which an earlier `$' would
+	 put there as well.  */
+      preorder (body, count_line_last, &nline_last);
+      if (nline_last > 1)
+	return;
+      dfa->trailing_dot_star_eol = 1;
+      node = node->left;
+    }
+  while (node != NULL
+	 && (node->token.type == CONCAT || node->token.type == SUBEXP))
+    node = node->token.type == CONCAT ? node->right : node->left;
+  dfa->trailing_dot_star = any_star_p (dfa, node);
+}
+
+/* Return true if NODE matches any byte that is not ASCII, so that in a
+   UTF-8 locale it is meant to match any multibyte character.  */
+
+static bool
+utf8_any_p (const bin_tree_t *node)
+{
+  int ch;
+  if (node->token.type == OP_PERIOD)
+    return true;
+  if (node->token.type != SIMPLE_BRACKET)
+    return false;
+  for (ch = ASCII_CHARS; ch < SBC_MAX; ++ch)
+    if (!bitset_contain (node->token.opr.sbcset, ch))
+      return false;
+  return true;
+}
+
+/* Return a new SIMPLE_BRACKET node matching the bytes FIRST to LAST.  */
+
+static bin_tree_t *
+create_byte_range_tree (re_dfa_t *dfa, int first, int last)
+{
+  re_token_t token;
+  bin_tree_t *tree;
+  int ch;
+
+  token.type = SIMPLE_BRACKET;
+  token.opr.sbcset = (re_bitset_ptr_t) calloc (sizeof (bitset_t), 1);
+  if (BE (token.opr.sbcset == NULL, 0))
+    return NULL;
+  for (ch = first; ch <= last; ++ch)
+    bitset_set (token.opr.sbcset, ch);
+  tree = create_token_tree (dfa, NULL, NULL, &token);
+  if (BE (tree == NULL, 0))
+    re_free (token.opr.sbcset);
+  return tree;
+}
+
+/* Return a tree matching what NODE matches, or a UTF-8 sequence of two to
+   four bytes.  NODE itself still matches a single non-ASCII byte, so that
+   invalid sequences are matched as before.  */
+
+static bin_tree_t *
+lower_utf8_any (re_dfa_t *dfa, bin_tree_t *node, reg_errcode_t *err)
+{
+  static const unsigned char lead_bytes[3][2] =
+    { { 0xc2, 0xdf }, { 0xe0, 0xef }, { 0xf0, 0xf4 } };
+  bin_tree_t *tree = node, *seq, *cont;
+  int len, i;
+
+  for (len = 2; len <= 4; ++len)
+    {
+      seq = create_byte_range_tree (dfa, lead_bytes[len - 2][0],
+				    lead_bytes[len - 2][1]);
+      for (i = 1; seq != NULL && i < len; ++i)
+	{
+	  cont = create_byte_range_tree (dfa, 0x80, 0xbf);
+	  seq = cont ? create_tree (dfa, seq, cont, CONCAT) : NULL;
+	}
+      tree = seq ? create_tree (dfa, tree, seq, OP_ALT) : NULL;
+      if (BE (tree == NULL, 0))
+	{
+	  *err = REG_ESPACE;
+	  return NULL;
+	}
+    }
+  return tree;
+}
+
+/* Lowering pass for UTF-8 locales when the matcher works on bytes: make
+   each `.' and each bracket that accepts every non-ASCII byte match a
+   whole multibyte character.  Operands of `*' are left alone, since
+   repeating them matches the same strings either way.  */
+
+static reg_errcode_t
+lower_utf8 (void *extra, bin_tree_t *node)
+{
+  re_dfa_t *dfa = (re_dfa_t *) extra;
+  reg_errcode_t err = REG_NOERROR;
+
+  if (node->token.type == OP_DUP_ASTERISK)
+    return REG_NOERROR;
+  if (node->left && utf8_any_p (node->left))
+    {
+      node->left = lower_utf8_any (dfa, node->left, &err);
+      if (node->left)
+	node->left->parent = node;
+    }
+  if (node->right && utf8_any_p (node->right))
+    {
+      node->right = lower_utf8_any (dfa, node->right, &err);
+      if (node->right)
+	node->right->parent = node;
+    }
+  return err;
+}
+
+/* Return true if upper-casing the input could be left out of matching
+   a case-insensitive pattern by folding its characters, that is, if
+   toupper is idempotent and keeps newlines, NULs and word characters
+   apart from the other bytes.  */
+
+static bool
+case_fold_simple_p (void)
+{
+  int ch;
+  for (ch = 0; ch < SBC_MAX; ++ch)
+    {
+      int up = toupper (ch);
+      if (toupper (up) != up
+	  || (up == '\n') != (ch == '\n') || (up == '\0') != (ch == '\0')
+	  || (isalnum (up) || up == '_') != (isalnum (ch) || ch == '_'))
+	return false;
+    }
+  return true;
+}
+
+/* Pass for case-insensitive patterns: make each character or bracket,
+   which RE_ICASE compares with the upper-cased input, match every byte
+   that upper-cases to what it matched.  */
+
+static reg_errcode_t
+fold_case (void *extra, bin_tree_t *node)
+{
+  bitset_t folded;
+  bool multi = false;
+  int ch, up;
+
+  if (node->token.type == CHARACTER)
+    {
+      up = node->token.opr.c;
+      bitset_empty (folded);
+      for (ch = 0; ch < SBC_MAX; ++ch)
+	if (toupper (ch) == up)
+	  {
+	    bitset_set (folded, ch);
+	    multi |= ch != up;
+	  }
+      if (!multi && bitset_contain (folded, up))
+	return REG_NOERROR;
+
+      node->token.type = SIMPLE_BRACKET;
+      node->token.opr.sbcset = (re_bitset_ptr_t) malloc (sizeof (bitset_t));
+      node->token.duplicated = 0;
+      if (BE (node->token.opr.sbcset == NULL, 0))
+	return REG_ESPACE;
+      bitset_copy (node->token.opr.sbcset, folded);
+    }
+  else if (node->token.type == SIMPLE_BRACKET)
+    {
+      /* Since toupper is idempotent, folding a bitset again, as happens
+	 when it is shared by duplicated trees, does not change it.  */
+      bitset_empty (folded);
+      for (ch = 0; ch < SBC_MAX; ++ch)
+	if (bitset_contain (node->token.opr.sbcset, toupper (ch)))
+	  bitset_set (folded, ch);
+      bitset_copy (node->token.opr.sbcset, folded);
+    }
+  return REG_NOERROR;
+}
+
 /* Lowering pass: Turn each SUBEXP node into the appropriate concatenation
    of OP_OPEN_SUBEXP, the body of the SUBEXP (if any) and OP_CLOSE_SUBEXP.  */
 static reg_errcode_t
@@ -2157,6 +2898,9 @@ parse_reg_exp (re_string_t *regexp, regex_t *preg, re_token_t *token,
 	  *err = REG_ESPACE;
 	  return NULL;
 	}
+      tree = optimize_alt (dfa, tree, err);
+      if (BE (tree == NULL, 0))
+	return NULL;
     }
   return tree;
 }
@@ -2563,6 +3307,42 @@ parse_dup_op (bin_tree_t *elem, re_string_t *regexp, re_dfa_t *dfa,
   if (elem->token.type == SUBEXP)
     postorder (elem, mark_opt_subexp, (void *) (long) elem->token.opr.idx);
 
+  if (end != REG_MISSING && end - start > 1 && !has_subexp_p (elem))
+    {
+      /* Rewrite <re>{0,n} as (<re>(<re>...(<re>)?...)?)?.  Nesting to the
+	 right means that after k copies only the k+1-th one and the exit
+	 are reachable, so the states of the DFA keep a constant size
+	 instead of holding every copy that could still be skipped, which
+	 made large bounds such as .\{0,4096\} quadratic.  This changes
+	 which copy an empty iteration is attributed to, so it is only
+	 done when <re> has no subexpression to report.  */
+      elem->parent = NULL;
+      tree = NULL;
+      for (i = start + 2; i <= end; ++i)
+	{
+	  bin_tree_t *copy = duplicate_tree (elem, dfa);
+	  if (BE (copy == NULL, 0))
+	    goto parse_dup_op_espace;
+	  if (tree != NULL)
+	    {
+	      copy = create_tree (dfa, copy, tree, CONCAT);
+	      if (BE (copy == NULL, 0))
+		goto parse_dup_op_espace;
+	    }
+	  tree = create_tree (dfa, copy, NULL, OP_ALT);
+	  if (BE (tree == NULL, 0))
+	    goto parse_dup_op_espace;
+	}
+      elem = create_tree (dfa, elem, tree, CONCAT);
+      tree = create_tree (dfa, elem, NULL, OP_ALT);
+      if (BE (elem == NULL || tree == NULL, 0))
+	goto parse_dup_op_espace;
+
+      if (old_tree)
+	tree = create_tree (dfa, old_tree, tree, CONCAT);
+      return tree;
+    }
+
   tree = create_tree (dfa, elem, NULL,
 		      (end == REG_MISSING ? OP_DUP_ASTERISK : OP_ALT));
   if (BE (tree == NULL, 0))
@@ -3780,6 +4560,36 @@ mark_opt_subexp (void *extra, bin_tree_t *node)
   return REG_NOERROR;
 }
 
+/* Return true if the tree ROOT contains a subexpression.  */
+
+static bool
+has_subexp_p (const bin_tree_t *root)
+{
+  const bin_tree_t *node;
+
+  for (node = root; ; )
+    {
+      if (node->token.type == SUBEXP)
+	return true;
+
+      /* Go to the left node, or up and to the right.  */
+      if (node->left)
+	node = node->left;
+      else
+	{
+	  const bin_tree_t *prev = NULL;
+	  while (node->right == prev || node->right == NULL)
+	    {
+	      if (node == root)
+		return false;
+	      prev = node;
+	      node = node->parent;
+	    }
+	  node = node->right;
+	}
+    }
+}
+
 /* Free the allocated memory inside NODE. */
 
 static void
@@ -233,6 +233,14 @@ typedef unsigned long int reg_syntax_t;
    stored in the pattern buffer, so changing this does not affect
    already-compiled regexps.  */
 extern reg_syntax_t re_syntax_options;
+
+/* If nonzero, the number of steps a search may spend matching back
+   references and finding subexpressions before it gives up with
+   REG_ELIMIT.  re_search and its relatives then return -3, which is
+   distinct from the -2 they return for internal errors.  This bounds
+   the time one search can take on patterns whose matching is not
+   linear.  */
+extern unsigned long int re_step_limit;
 
 #ifdef __USE_GNU_REGEX
 /* Define combinations of the above bits for the standard possibilities.
@@ -365,6 +373,11 @@ extern reg_syntax_t re_syntax_options;
    buffer.  */
 #define REG_STARTEND (1 << 2)
 
+/* Only find out whether there is a match and where it starts: stop at
+   the first accepting state instead of looking for the longest match,
+   so PMATCH[0].rm_eo may be short.  Ignored if NMATCH is greater than 1.  */
+#define REG_NOLONGEST (1 << 3)
+
 
 /* If any error codes are removed, changed, or added, update the
    `__re_error_msgid' table in regcomp.c.  */
@@ -393,7 +406,8 @@ typedef enum
   /* Error codes we've added.  */
   _REG_EEND,		/* Premature end.  */
   _REG_ESIZE,		/* Compiled pattern bigger than 2^16 bytes.  */
-  _REG_ERPAREN		/* Unmatched ) or \); not returned from regcomp.  */
+  _REG_ERPAREN,		/* Unmatched ) or \); not returned from regcomp.  */
+  _REG_ELIMIT		/* Search exceeded re_step_limit (for regexec).  */
 } reg_errcode_t;
 
 #ifdef _XOPEN_SOURCE
@@ -416,6 +430,7 @@ typedef enum
 #define REG_EEND	_REG_EEND
 #define REG_ESIZE	_REG_ESIZE
 #define REG_ERPAREN	_REG_ERPAREN
+#define REG_ELIMIT	_REG_ELIMIT
 
 /* struct re_pattern_buffer normally uses member names like `buffer'
    that POSIX does not allow.  In POSIX mode these members have names
@@ -486,7 +501,11 @@ struct re_pattern_buffer
   /* If REGS_UNALLOCATED, allocate space in the `regs' structure
      for `max (RE_NREGS, re_nsub + 1)' groups.
      If REGS_REALLOCATE, reallocate space if necessary.
-     If REGS_FIXED, use what's there.  */
+     If REGS_FIXED, use what's there.
+     The first search given a `regs' structure changes REGS_UNALLOCATED
+     to REGS_REALLOCATE.  Searches otherwise write nothing in the
+     pattern buffer, so one shared between threads that pass `regs'
+     must have this set to REGS_REALLOCATE or REGS_FIXED first.  */
 #ifdef __USE_GNU_REGEX
 # define REGS_UNALLOCATED 0
 # define REGS_REALLOCATE 1
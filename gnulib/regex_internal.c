@@ -1463,6 +1463,44 @@ calc_state_hash (const re_node_set *nodes, unsigned int context)
   return hash;
 }
 
+/* Return the state of the bucket SPOT whose node_set is NODES, or NULL.
+   This may run without the lock, see re_state_table_entry.  */
+
+static re_dfastate_t *
+find_ci_state (const struct re_state_table_entry *spot,
+	       const re_node_set *nodes, re_hashval_t hash)
+{
+  re_dfastate_t *const *array = load_acquire (spot->array);
+  re_dfastate_t *state;
+  Idx i;
+
+  if (array != NULL)
+    for (i = 0; (state = load_acquire (array[i])) != NULL; i++)
+      if (hash == state->hash && re_node_set_compare (&state->nodes, nodes))
+	return state;
+  return NULL;
+}
+
+/* Likewise for the state entered with NODES in the context CONTEXT.  */
+
+static re_dfastate_t *
+find_cd_state (const struct re_state_table_entry *spot,
+	       const re_node_set *nodes, unsigned int context,
+	       re_hashval_t hash)
+{
+  re_dfastate_t *const *array = load_acquire (spot->array);
+  re_dfastate_t *state;
+  Idx i;
+
+  if (array != NULL)
+    for (i = 0; (state = load_acquire (array[i])) != NULL; i++)
+      if (state->hash == hash
+	  && state->context == context
+	  && re_node_set_compare (state->entrance_nodes, nodes))
+	return state;
+  return NULL;
+}
+
 /* Search for the state whose node_set is equivalent to NODES.
    Return the pointer to the state, if we found it in the DFA.
    Otherwise create the new one and return it.  In case of an error
@@ -1480,7 +1518,6 @@ re_acquire_state (reg_errcode_t *err, const re_dfa_t *dfa,
   re_hashval_t hash;
   re_dfastate_t *new_state;
   struct re_state_table_entry *spot;
-  Idx i;
 #ifdef lint
   /* Suppress bogus uninitialized-variable warnings.  */
   *err = REG_NOERROR;
@@ -1493,19 +1530,21 @@ re_acquire_state (reg_errcode_t *err, const re_dfa_t *dfa,
   hash = calc_state_hash (nodes, 0);
   spot = dfa->state_table + (hash & dfa->state_hash_mask);
 
-  for (i = 0 ; i < spot->num ; i++)
+  new_state = find_ci_state (spot, nodes, hash);
+  if (new_state != NULL)
+    return new_state;
+
+  /* Look again under the lock, another search may have added it.  */
+  re_dfa_lock (dfa);
+  new_state = find_ci_state (spot, nodes, hash);
+  if (new_state == NULL)
     {
-      re_dfastate_t *state = spot->array[i];
-      if (hash != state->hash)
-	continue;
-      if (re_node_set_compare (&state->nodes, nodes))
-	return state;
+      /* There are no appropriate state in the dfa, create the new one.  */
+      new_state = create_ci_newstate (dfa, nodes, hash);
+      if (BE (new_state == NULL, 0))
+	*err = REG_ESPACE;
     }
-
-  /* There are no appropriate state in the dfa, create the new one.  */
-  new_state = create_ci_newstate (dfa, nodes, hash);
-  if (BE (new_state == NULL, 0))
-    *err = REG_ESPACE;
+  re_dfa_unlock (dfa);
 
   return new_state;
 }
@@ -1528,7 +1567,6 @@ re_acquire_state_context (reg_errcode_t *err, const re_dfa_t *dfa,
   re_hashval_t hash;
   re_dfastate_t *new_state;
   struct re_state_table_entry *spot;
-  Idx i;
 #ifdef lint
   /* Suppress bogus uninitialized-variable warnings.  */
   *err = REG_NOERROR;
@@ -1541,18 +1579,21 @@ re_acquire_state_context (reg_errcode_t *err, const re_dfa_t *dfa,
   hash = calc_state_hash (nodes, context);
   spot = dfa->state_table + (hash & dfa->state_hash_mask);
 
-  for (i = 0 ; i < spot->num ; i++)
+  new_state = find_cd_state (spot, nodes, context, hash);
+  if (new_state != NULL)
+    return new_state;
+
+  /* Look again under the lock, another search may have added it.  */
+  re_dfa_lock (dfa);
+  new_state = find_cd_state (spot, nodes, context, hash);
+  if (new_state == NULL)
     {
-      re_dfastate_t *state = spot->array[i];
-      if (state->hash == hash
-	  && state->context == context
-	  && re_node_set_compare (state->entrance_nodes, nodes))
-	return state;
+      /* There are no appropriate state in `dfa', create the new one.  */
+      new_state = create_cd_newstate (dfa, nodes, context, hash);
+      if (BE (new_state == NULL, 0))
+	*err = REG_ESPACE;
     }
-  /* There are no appropriate state in `dfa', create the new one.  */
-  new_state = create_cd_newstate (dfa, nodes, context, hash);
-  if (BE (new_state == NULL, 0))
-    *err = REG_ESPACE;
+  re_dfa_unlock (dfa);
 
   return new_state;
 }
@@ -1582,17 +1623,41 @@ register_state (const re_dfa_t *dfa, re_dfastate_t *newstate,
     }
 
   spot = dfa->state_table + (hash & dfa->state_hash_mask);
-  if (BE (spot->alloc <= spot->num, 0))
+  /* Keep a null pointer after the last state.  */
+  if (BE (spot->alloc <= spot->num + 1, 0))
     {
       Idx new_alloc = 2 * spot->num + 2;
-      re_dfastate_t **new_array = re_realloc (spot->array, re_dfastate_t *,
-					      new_alloc);
+      re_dfastate_t **new_array;
+      new_array = (re_dfastate_t **) calloc (sizeof (re_dfastate_t *),
+					     new_alloc);
       if (BE (new_array == NULL, 0))
 	return REG_ESPACE;
-      spot->array = new_array;
+      if (spot->array != NULL)
+	{
+	  /* Searches may still be scanning the old array.  */
+	  re_dfa_t *mdfa = (re_dfa_t *) dfa;
+	  if (BE (mdfa->nretired == mdfa->retired_alloc, 0))
+	    {
+	      Idx new_retired_alloc = 2 * mdfa->retired_alloc + 4;
+	      re_dfastate_t ***new_retired;
+	      new_retired = re_realloc (mdfa->retired, re_dfastate_t **,
+					new_retired_alloc);
+	      if (BE (new_retired == NULL, 0))
+		{
+		  re_free (new_array);
+		  return REG_ESPACE;
+		}
+	      mdfa->retired = new_retired;
+	      mdfa->retired_alloc = new_retired_alloc;
+	    }
+	  mdfa->retired[mdfa->nretired++] = spot->array;
+	  memcpy (new_array, spot->array, spot->num * sizeof (re_dfastate_t *));
+	}
+      store_release (spot->array, new_array);
       spot->alloc = new_alloc;
     }
-  spot->array[spot->num++] = newstate;
+  store_release (spot->array[spot->num], newstate);
+  ++spot->num;
   return REG_NOERROR;
 }
 
@@ -40,12 +40,69 @@
 #include <wchar.h>
 #include <wctype.h>
 #include <stdint.h>
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define RE_USE_SSE2 1
+#endif
+/* The DFA of a compiled pattern grows lazily while it is searched: new
+   states go into its state table and new transition tables are attached
+   to its states.  LOCK serializes these insertions, and states and
+   transition tables are published with store_release once they are
+   complete, so that the common path of a search looks up states and
+   follows transitions with load_acquire and no locking.  Everything
+   else a search reads is only written at compile time, so threads
+   searching with the same pattern share one warmed DFA.
+   Outside of libc the lock is only compiled in if RE_THREAD_SAFE is
+   defined, since sed itself does not use threads.  load_acquire and
+   store_release take pointers; the _int forms take an unsigned int.  */
 #if defined _LIBC
+# include <atomic.h>
 # include <bits/libc-lock.h>
+# define lock_define(name) __libc_lock_define (, name)
+# define lock_init(lock) __libc_lock_init (lock)
+# define lock_fini(lock) ((void) 0)
+# define lock_lock(lock) __libc_lock_lock (lock)
+# define lock_unlock(lock) __libc_lock_unlock (lock)
+# define load_acquire(lval) atomic_load_acquire (&(lval))
+# define store_release(lval, val) atomic_store_release (&(lval), val)
+# define load_acquire_int(lval) atomic_load_acquire (&(lval))
+# define store_release_int(lval, val) atomic_store_release (&(lval), val)
+#elif defined RE_THREAD_SAFE && defined _WIN32
+# include <windows.h>
+# define lock_define(name) SRWLOCK name;
+# define lock_init(lock) InitializeSRWLock (&(lock))
+# define lock_fini(lock) ((void) 0)
+# define lock_lock(lock) AcquireSRWLockExclusive (&(lock))
+# define lock_unlock(lock) ReleaseSRWLockExclusive (&(lock))
+# define load_acquire(lval) (*(void *volatile *) &(lval))
+# define store_release(lval, val) \
+  InterlockedExchangePointer ((PVOID volatile *) &(lval), val)
+# define load_acquire_int(lval) (*(unsigned int volatile *) &(lval))
+# define store_release_int(lval, val) \
+  InterlockedExchange ((LONG volatile *) &(lval), val)
+#elif defined RE_THREAD_SAFE
+# include <pthread.h>
+# define lock_define(name) pthread_mutex_t name;
+# define lock_init(lock) pthread_mutex_init (&(lock), NULL)
+# define lock_fini(lock) pthread_mutex_destroy (&(lock))
+# define lock_lock(lock) pthread_mutex_lock (&(lock))
+# define lock_unlock(lock) pthread_mutex_unlock (&(lock))
+# define load_acquire(lval) __atomic_load_n (&(lval), __ATOMIC_ACQUIRE)
+# define store_release(lval, val) \
+  __atomic_store_n (&(lval), val, __ATOMIC_RELEASE)
+# define load_acquire_int(lval) __atomic_load_n (&(lval), __ATOMIC_ACQUIRE)
+# define store_release_int(lval, val) \
+  __atomic_store_n (&(lval), val, __ATOMIC_RELEASE)
 #else
-# define __libc_lock_init(NAME) do { } while (0)
-# define __libc_lock_lock(NAME) do { } while (0)
-# define __libc_lock_unlock(NAME) do { } while (0)
+# define lock_define(name)
+# define lock_init(lock) ((void) 0)
+# define lock_fini(lock) ((void) 0)
+# define lock_lock(lock) ((void) 0)
+# define lock_unlock(lock) ((void) 0)
+# define load_acquire(lval) (lval)
+# define store_release(lval, val) ((lval) = (val))
+# define load_acquire_int(lval) (lval)
+# define store_release_int(lval, val) ((lval) = (val))
 #endif
 
 /* In case that the system doesn't have isblank().  */
@@ -106,6 +163,10 @@
 
 #define COLL_ELEM_LEN_MAX 8
 
+/* Number of bytes a fastmap may have to be searched for byte by byte
+   rather than through the table.  */
+#define FASTMAP_BYTES_MAX 8
+
 /* The character which represents newline.  */
 #define NEWLINE_CHAR '\n'
 #define WIDE_NEWLINE_CHAR L'\n'
@@ -561,6 +622,10 @@ struct re_dfastate_t
 };
 typedef struct re_dfastate_t re_dfastate_t;
 
+/* A bucket of the state table.  ARRAY is terminated by a null pointer,
+   so that searches can scan it without the lock while a new state is
+   being added; a full ARRAY is replaced by a larger copy rather than
+   reallocated, and the old one is kept in the DFA's RETIRED list.  */
 struct re_state_table_entry
 {
   Idx num;
@@ -568,15 +633,20 @@ struct re_state_table_entry
   re_dfastate_t **array;
 };
 
-/* Array type used in re_sub_match_last_t and re_sub_match_top_t.  */
+/* Array type used in re_sub_match_last_t and re_sub_match_top_t.
+   ARRAY[I] holds the state at the string index BASE + I, so that a path
+   only takes memory for the part of the string it has walked.  */
 
 typedef struct
 {
   Idx next_idx;
+  Idx base;
   Idx alloc;
   re_dfastate_t **array;
 } state_array_t;
 
+#define PATH_STATE(path, idx) ((path)->array[(idx) - (path)->base])
+
 /* Store information about the node NODE whose type is OP_CLOSE_SUBEXP.  */
 
 typedef struct
@@ -636,6 +706,8 @@ typedef struct
   Idx nsub_tops;
   Idx asub_tops;
   re_sub_match_top_t **sub_tops;
+  /* The number of steps counted against re_step_limit.  */
+  unsigned long int steps;
 } re_match_context_t;
 
 typedef struct
@@ -662,6 +734,71 @@ struct re_fail_stack_t
   struct re_fail_stack_ent_t *stack;
 };
 
+/* Limit on the number of states of a DFA determinized at compile time,
+   the larger limit used once the pattern has been searched
+   FLAT_DFA_HOT_SEARCHES times, and the transition used for the dead state
+   in the table.  */
+#define FLAT_DFA_STATES_MAX 64
+#define FLAT_DFA_HOT_STATES_MAX 1024
+#define FLAT_DFA_HOT_SEARCHES 1000
+#define FLAT_DFA_DEAD 0xffff
+
+/* Bit-parallel (Shift-And) matcher for patterns that are a fixed-length
+   sequence of characters, brackets and periods.  */
+typedef struct
+{
+  /* Bit I of MASKS[C] is set if position I of the pattern accepts C.  */
+  uint64_t masks[SBC_MAX];
+  /* The number of positions, which is the length of every match.  */
+  Idx len;
+  /* The start and end of each subexpression relative to the start of
+     the match, or -1.  */
+  regoff_t *offsets;
+} re_shift_and_t;
+
+/* Matcher for patterns that are a character, bracket or period repeated
+   with `*' or `+', possibly anchored with `^' and `$': a match is a run
+   of bytes the repeated item accepts.  */
+typedef struct
+{
+  /* MEMBER[C] is nonzero if the item accepts C.  */
+  unsigned char member[SBC_MAX];
+  /* The bytes the item accepts and the bytes it rejects, if there are
+     at most FASTMAP_BYTES_MAX of them; otherwise the count is 0.  */
+  unsigned char nmembers;
+  unsigned char nothers;
+  unsigned char members[FASTMAP_BYTES_MAX];
+  unsigned char others[FASTMAP_BYTES_MAX];
+  /* The item is repeated with `+' rather than `*'.  */
+  unsigned int nonempty : 1;
+  unsigned int bol : 1;
+  unsigned int eol : 1;
+} re_class_run_t;
+
+/* Limits on the literal prefixes collected for re_literals_t: their
+   number, and their length.  */
+#define LITERALS_MAX 1024
+#define LITERAL_LEN_MAX 16
+
+/* Aho-Corasick automaton over a set of literals, one of which starts
+   every match of the pattern.  Searching with it finds the next place
+   where a match can start much faster than trying every byte that the
+   fastmap allows, when there are many literals.  */
+typedef struct
+{
+  /* Bytes that occur in no literal share class 0.  */
+  unsigned char classes[SBC_MAX];
+  Idx nclasses;
+  /* TRANS[S * NCLASSES + C] is the state reached from state S on a byte
+     of class C; state 0 is the initial state.  */
+  unsigned int *trans;
+  /* OUT[S] is the length of the longest literal that ends in state S,
+     or 0 if there is none.  */
+  unsigned char *out;
+  /* The length of the longest literal.  */
+  Idx max_len;
+} re_literals_t;
+
 struct re_dfa_t
 {
   re_token_t *nodes;
@@ -673,6 +810,10 @@ struct re_dfa_t
   re_node_set *eclosures;
   re_node_set *inveclosures;
   struct re_state_table_entry *state_table;
+  /* Bucket arrays replaced by larger ones; see re_state_table_entry.  */
+  re_dfastate_t ***retired;
+  Idx nretired;
+  Idx retired_alloc;
   re_dfastate_t *init_state;
   re_dfastate_t *init_state_word;
   re_dfastate_t *init_state_nl;
@@ -699,18 +840,52 @@ struct re_dfa_t
   unsigned int is_utf8 : 1;
   unsigned int map_notascii : 1;
   unsigned int word_ops_used : 1;
+  /* The pattern begins with a `.*' that matches any byte, so if it does
+     not match at the first starting position it does not match later.  */
+  unsigned int leading_dot_star : 1;
+  /* The pattern ends with such a `.*' (optionally followed by `$'), so
+     the longest match always extends to the end of the input.  */
+  unsigned int trailing_dot_star : 1;
+  unsigned int trailing_dot_star_eol : 1;
+  /* The bytes set in the fastmap, if there are at most FASTMAP_BYTES_MAX
+     of them; otherwise FASTMAP_NBYTES is 0.  */
+  unsigned char fastmap_nbytes;
+  unsigned char fastmap_bytes[FASTMAP_BYTES_MAX];
   int mb_cur_max;
   bitset_t word_char;
   reg_syntax_t syntax;
   Idx *subexp_map;
+  /* For a pattern `<re>$' without anchors or back references in <re>,
+     the automaton of <re> reversed, used to find the leftmost start of
+     a match by scanning backward from the end of the input.  */
+  re_dfa_t *rev_dfa;
+  /* The bit-parallel matcher used instead of the DFA, or NULL.  */
+  re_shift_and_t *shift_and;
+  /* The run matcher used instead of the DFA, or NULL.  */
+  re_class_run_t *class_run;
+  /* The literal prefixes of the pattern, or NULL.  */
+  re_literals_t *literals;
+  /* For a small DFA without constraints, the whole DFA determinized at
+     compile time, or after NSEARCHES reaches FLAT_DFA_HOT_SEARCHES:
+     FLAT_TRANS[S * SBC_MAX + C] is the state reached from state S on
+     byte C, or FLAT_DFA_DEAD; state 0 is the initial state.  FLAT_HALT[S]
+     is nonzero if S is a halt state; it lives in the same block.  */
+  unsigned short *flat_trans;
+  unsigned char *flat_halt;
+  /* The number of searches so far, up to FLAT_DFA_HOT_SEARCHES.  It is
+     also set to that once create_flat_dfa has built FLAT_TRANS or found
+     that it never can, so that searches stop counting.  */
+  unsigned int nsearches;
 #ifdef DEBUG
   char* re_str;
 #endif
-#ifdef _LIBC
-  __libc_lock_define (, lock)
-#endif
+  lock_define (lock)
 };
 
+/* The matcher only sees a const DFA, but still has to take its lock.  */
+#define re_dfa_lock(dfa) lock_lock (((re_dfa_t *) (dfa))->lock)
+#define re_dfa_unlock(dfa) lock_unlock (((re_dfa_t *) (dfa))->lock)
+
 #define re_node_set_init_empty(set) memset (set, '\0', sizeof (re_node_set))
 #define re_node_set_remove(set,id) \
   (re_node_set_remove_at (set, re_node_set_contains (set, id) - 1))
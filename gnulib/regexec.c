@@ -18,6 +18,19 @@
    with this program; if not, write to the Free Software Foundation,
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA. */
 
+/* See regex.h.  This has no initializer for the same reason as
+   re_syntax_options.  */
+unsigned long int re_step_limit;
+
+/* Count one step of the search MCTX, and return true if that exceeds
+   re_step_limit.  */
+
+static inline bool
+step_limit_exceeded (re_match_context_t *mctx)
+{
+  return re_step_limit != 0 && ++mctx->steps > re_step_limit;
+}
+
 static reg_errcode_t match_ctx_init (re_match_context_t *cache, int eflags,
 				     Idx n) internal_function;
 static void match_ctx_clean (re_match_context_t *mctx) internal_function;
@@ -41,6 +54,29 @@ static reg_errcode_t re_search_internal (const regex_t *preg,
 					 Idx start, Idx last_start, Idx stop,
 					 size_t nmatch, regmatch_t pmatch[],
 					 int eflags) internal_function;
+static Idx search_reverse (const regex_t *preg, const char *string,
+			   Idx length, Idx start) internal_function;
+static reg_errcode_t shift_and_search (const regex_t *preg,
+				       const char *string, Idx start,
+				       Idx last_start, Idx stop,
+				       const char *fastmap, size_t nmatch,
+				       regmatch_t pmatch[]) internal_function;
+static reg_errcode_t class_run_search (const regex_t *preg,
+				       const char *string, Idx start,
+				       Idx last_start, Idx stop, size_t nmatch,
+				       regmatch_t pmatch[], int eflags)
+     internal_function;
+static Idx skip_class_run (const re_class_run_t *cr, bool member,
+			   const char *string, Idx idx, Idx lim)
+     internal_function;
+static Idx skip_to_fastmap_byte (const re_dfa_t *dfa, const char *fastmap,
+				 const char *string, Idx idx, Idx lim)
+     internal_function;
+#ifdef RE_USE_SSE2
+static Idx scan_byte_set (const unsigned char *bytes, int nbytes, bool in_set,
+			  const char *string, Idx idx, Idx lim)
+     internal_function;
+#endif
 static regoff_t re_search_2_stub (struct re_pattern_buffer *bufp,
 				  const char *string1, Idx length1,
 				  const char *string2, Idx length2,
@@ -59,6 +95,9 @@ static reg_errcode_t prune_impossible_nodes (re_match_context_t *mctx)
      internal_function;
 static Idx check_matching (re_match_context_t *mctx, bool fl_longest_match,
 			   Idx *p_match_first) internal_function;
+static bool trailing_dot_star_halt (const re_match_context_t *mctx,
+				    const re_dfastate_t *state)
+     internal_function;
 static Idx check_halt_state_context (const re_match_context_t *mctx,
 				     const re_dfastate_t *state, Idx idx)
      internal_function;
@@ -165,7 +204,10 @@ static reg_errcode_t check_arrival (re_match_context_t *mctx,
 				    state_array_t *path, Idx top_node,
 				    Idx top_str, Idx last_node, Idx last_str,
 				    int type) internal_function;
+static reg_errcode_t extend_path (state_array_t *path, Idx last_idx)
+     internal_function;
 static reg_errcode_t check_arrival_add_next_nodes (re_match_context_t *mctx,
+						   state_array_t *path,
 						   Idx str_idx,
 						   re_node_set *cur_nodes,
 						   re_node_set *next_nodes)
@@ -179,9 +221,16 @@ static reg_errcode_t check_arrival_expand_ecl_sub (const re_dfa_t *dfa,
 						   Idx target, Idx ex_subexp,
 						   int type) internal_function;
 static reg_errcode_t expand_bkref_cache (re_match_context_t *mctx,
+					 state_array_t *path,
 					 re_node_set *cur_nodes, Idx cur_str,
 					 Idx subexp_num, int type)
      internal_function;
+static bool hot_dfa_p (const re_dfa_t *dfa) internal_function;
+static Idx skip_to_literal (const re_literals_t *lits, const char *string,
+			    Idx idx, Idx stop) internal_function;
+static void publish_trtable (const re_dfa_t *dfa, re_dfastate_t *state,
+			     re_dfastate_t **trtable, bool word)
+     internal_function;
 static bool build_trtable (const re_dfa_t *dfa,
 			   re_dfastate_t *state) internal_function;
 #ifdef RE_ENABLE_I18N
@@ -216,7 +265,8 @@ static reg_errcode_t extend_buffers (re_match_context_t *mctx)
 
    EFLAGS specifies `execution flags' which affect matching: if
    REG_NOTBOL is set, then ^ does not match at the beginning of the
-   string; if REG_NOTEOL is set, then $ does not match at the end.
+   string; if REG_NOTEOL is set, then $ does not match at the end;
+   if REG_NOLONGEST is set, we stop at the first match found.
 
    We return 0 if we find a match and REG_NOMATCH if not.  */
 
@@ -230,11 +280,8 @@ regexec (preg, string, nmatch, pmatch, eflags)
 {
   reg_errcode_t err;
   Idx start, length;
-#ifdef _LIBC
-  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
-#endif
 
-  if (eflags & ~(REG_NOTBOL | REG_NOTEOL | REG_STARTEND))
+  if (eflags & ~(REG_NOTBOL | REG_NOTEOL | REG_STARTEND | REG_NOLONGEST))
     return REG_BADPAT;
 
   if (eflags & REG_STARTEND)
@@ -248,17 +295,266 @@ regexec (preg, string, nmatch, pmatch, eflags)
       length = strlen (string);
     }
 
-  __libc_lock_lock (dfa->lock);
   if (preg->no_sub)
     err = re_search_internal (preg, string, length, start, length,
 			      length, 0, NULL, eflags);
   else
     err = re_search_internal (preg, string, length, start, length,
 			      length, nmatch, pmatch, eflags);
-  __libc_lock_unlock (dfa->lock);
   return err != REG_NOERROR;
 }
 
+/* Run the reversed automaton of the pattern PREG, which must be of the
+   form `<re>$', backward from the end of STRING of length LENGTH.  Return
+   the leftmost position not before START from which <re> matches up to
+   the end of STRING, REG_MISSING if there is none, or REG_ERROR if we
+   run out of memory.  */
+
+static Idx
+internal_function
+search_reverse (const regex_t *preg, const char *string, Idx length,
+		Idx start)
+{
+  const re_dfa_t *rdfa = ((const re_dfa_t *) preg->buffer)->rev_dfa;
+  RE_TRANSLATE_TYPE t = preg->translate;
+  bool icase = (preg->syntax & RE_ICASE) != 0;
+  re_dfastate_t *state = rdfa->init_state;
+  Idx idx = length;
+  Idx found = state->halt ? idx : REG_MISSING;
+
+  while (idx > start)
+    {
+      int ch = (unsigned char) string[--idx];
+      re_dfastate_t **trtable;
+      if (t != NULL)
+	ch = (unsigned char) t[ch];
+      if (icase)
+	ch = toupper (ch);
+      trtable = load_acquire (state->trtable);
+      if (BE (trtable == NULL, 0)
+	  && (!build_trtable (rdfa, state)
+	      || (trtable = load_acquire (state->trtable)) == NULL))
+	return REG_ERROR;
+      state = trtable[ch];
+      if (state == NULL)
+	break;
+      if (state->halt)
+	found = idx;
+    }
+  return found;
+}
+
+/* Search STRING for the pattern PREG, which has a bit-parallel matcher,
+   with a match starting in [START, LAST_START] and ending before STOP.
+   FASTMAP is used to skip to possible starts, if it is not NULL.  Set
+   the NMATCH elements of PMATCH like re_search_internal does.  */
+
+static reg_errcode_t
+internal_function
+shift_and_search (const regex_t *preg, const char *string, Idx start,
+		  Idx last_start, Idx stop, const char *fastmap,
+		  size_t nmatch, regmatch_t pmatch[])
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+  const re_shift_and_t *sa = dfa->shift_and;
+  uint64_t d = 0, last_bit = (uint64_t) 1 << (sa->len - 1);
+  Idx idx, end, match_first;
+  size_t reg_idx;
+
+  if (dfa->fastmap_nbytes == 0)
+    fastmap = NULL;
+  end = (last_start < stop - sa->len) ? last_start + sa->len : stop;
+  for (idx = start; idx < end; ++idx)
+    {
+      if (d == 0 && fastmap != NULL)
+	{
+	  idx = skip_to_fastmap_byte (dfa, fastmap, string, idx, end);
+	  if (idx == end)
+	    break;
+	}
+      d = ((d << 1) | 1) & sa->masks[(unsigned char) string[idx]];
+      if (d & last_bit)
+	break;
+    }
+  if (idx >= end)
+    return REG_NOMATCH;
+
+  match_first = idx + 1 - sa->len;
+  if (nmatch > 0)
+    {
+      pmatch[0].rm_so = match_first;
+      pmatch[0].rm_eo = match_first + sa->len;
+    }
+  for (reg_idx = 1; reg_idx < nmatch; ++reg_idx)
+    {
+      Idx sub = reg_idx - 1;
+      if (preg->no_sub || sub >= preg->re_nsub)
+	{
+	  pmatch[reg_idx].rm_so = pmatch[reg_idx].rm_eo = -1;
+	  continue;
+	}
+      if (dfa->subexp_map)
+	sub = dfa->subexp_map[sub];
+      if (sa->offsets[2 * sub] == -1 || sa->offsets[2 * sub + 1] == -1)
+	pmatch[reg_idx].rm_so = pmatch[reg_idx].rm_eo = -1;
+      else
+	{
+	  pmatch[reg_idx].rm_so = match_first + sa->offsets[2 * sub];
+	  pmatch[reg_idx].rm_eo = match_first + sa->offsets[2 * sub + 1];
+	}
+    }
+  return REG_NOERROR;
+}
+
+/* Search STRING for the pattern PREG, which has a run matcher, with a
+   match starting in [START, LAST_START] and ending before STOP, which
+   is the end of the input if the pattern ends with `$'.  Set the NMATCH
+   elements of PMATCH like re_search_internal does.  */
+
+static reg_errcode_t
+internal_function
+class_run_search (const regex_t *preg, const char *string, Idx start,
+		  Idx last_start, Idx stop, size_t nmatch,
+		  regmatch_t pmatch[], int eflags)
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+  const re_class_run_t *cr = dfa->class_run;
+  Idx match_first, match_last;
+  size_t reg_idx;
+
+  if (cr->bol && (start != 0 || (eflags & REG_NOTBOL)))
+    return REG_NOMATCH;
+
+  if (cr->eol)
+    {
+      /* Only the run that ends at STOP can match.  */
+      match_first = stop;
+      while (match_first > start
+	     && cr->member[(unsigned char) string[match_first - 1]])
+	--match_first;
+      if ((cr->bol && match_first != 0) || match_first > last_start
+	  || (cr->nonempty && match_first == stop))
+	return REG_NOMATCH;
+      match_last = stop;
+    }
+  else
+    {
+      match_first = start;
+      if (cr->nonempty && !cr->bol)
+	{
+	  Idx lim = last_start < stop ? last_start + 1 : stop;
+	  match_first = skip_class_run (cr, true, string, start, lim);
+	  if (match_first == lim)
+	    return REG_NOMATCH;
+	}
+      match_last = skip_class_run (cr, false, string, match_first, stop);
+      if (cr->nonempty && match_last == match_first)
+	return REG_NOMATCH;
+    }
+
+  if (nmatch > 0)
+    {
+      pmatch[0].rm_so = match_first;
+      pmatch[0].rm_eo = match_last;
+    }
+  for (reg_idx = 1; reg_idx < nmatch; ++reg_idx)
+    pmatch[reg_idx].rm_so = pmatch[reg_idx].rm_eo = -1;
+  return REG_NOERROR;
+}
+
+/* Return the first index in [IDX, LIM) at which STRING has a byte that
+   the item of CR accepts if MEMBER is true, or rejects otherwise, or
+   LIM if there is none.  */
+
+static Idx
+internal_function
+skip_class_run (const re_class_run_t *cr, bool member, const char *string,
+		Idx idx, Idx lim)
+{
+#ifdef RE_USE_SSE2
+  if (cr->nmembers != 0)
+    idx = scan_byte_set (cr->members, cr->nmembers, member, string, idx, lim);
+  else if (cr->nothers != 0)
+    idx = scan_byte_set (cr->others, cr->nothers, !member, string, idx, lim);
+#endif
+  while (idx < lim && (cr->member[(unsigned char) string[idx]] != 0) != member)
+    ++idx;
+  return idx;
+}
+
+/* Return the first index in [IDX, LIM) at which STRING has a byte set in
+   FASTMAP, or LIM if there is none.  The DFA->FASTMAP_NBYTES bytes set
+   in FASTMAP are looked for directly: with memchr if there is one, and
+   sixteen bytes at a time if SSE2 is available.  */
+
+static Idx
+internal_function
+skip_to_fastmap_byte (const re_dfa_t *dfa, const char *fastmap,
+		      const char *string, Idx idx, Idx lim)
+{
+  if (dfa->fastmap_nbytes == 1)
+    {
+      const char *p = memchr (string + idx, dfa->fastmap_bytes[0], lim - idx);
+      return p ? p - string : lim;
+    }
+
+#ifdef RE_USE_SSE2
+  idx = scan_byte_set (dfa->fastmap_bytes, dfa->fastmap_nbytes, true,
+		       string, idx, lim);
+#endif
+
+  while (idx < lim && !fastmap[(unsigned char) string[idx]])
+    ++idx;
+  return idx;
+}
+
+#ifdef RE_USE_SSE2
+/* Return the first index in [IDX, LIM) at which STRING has one of the
+   NBYTES bytes in BYTES if IN_SET is true, or a byte that is none of
+   them otherwise.  Sixteen bytes are checked at a time, so the result
+   is where fewer than sixteen are left if no such byte comes before;
+   the caller checks the rest.  */
+
+static Idx
+internal_function
+scan_byte_set (const unsigned char *bytes, int nbytes, bool in_set,
+	       const char *string, Idx idx, Idx lim)
+{
+  __m128i set[FASTMAP_BYTES_MAX];
+  unsigned int flip = in_set ? 0 : 0xffff;
+  int i;
+
+  if (lim - idx < 16)
+    return idx;
+  for (i = 0; i < nbytes; ++i)
+    set[i] = _mm_set1_epi8 ((char) bytes[i]);
+  for (; lim - idx >= 16; idx += 16)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *) (string + idx));
+      __m128i hit = _mm_cmpeq_epi8 (chunk, set[0]);
+      unsigned int mask;
+
+      for (i = 1; i < nbytes; ++i)
+	hit = _mm_or_si128 (hit, _mm_cmpeq_epi8 (chunk, set[i]));
+      mask = _mm_movemask_epi8 (hit) ^ flip;
+      if (mask != 0)
+	{
+# ifdef __GNUC__
+	  return idx + __builtin_ctz (mask);
+# else
+	  while (!(mask & 1))
+	    {
+	      mask >>= 1;
+	      ++idx;
+	    }
+	  return idx;
+# endif
+	}
+    }
+  return idx;
+}
+#endif
+
 #ifdef _LIBC
 # include <shlib-compat.h>
 versioned_symbol (libc, __regexec, regexec, GLIBC_2_3_4);
@@ -425,9 +721,6 @@ re_search_stub (struct re_pattern_buffer *bufp,
   Idx nregs;
   regoff_t rval;
   int eflags = 0;
-#ifdef _LIBC
-  re_dfa_t *dfa = (re_dfa_t *) bufp->buffer;
-#endif
   Idx last_start = start + range;
 
   /* Check for out-of-range.  */
@@ -438,18 +731,26 @@ re_search_stub (struct re_pattern_buffer *bufp,
   else if (BE (last_start < 0 || (range < 0 && start <= last_start), 0))
     last_start = 0;
 
-  __libc_lock_lock (dfa->lock);
-
   eflags |= (bufp->not_bol) ? REG_NOTBOL : 0;
   eflags |= (bufp->not_eol) ? REG_NOTEOL : 0;
 
-  /* Compile fastmap if we haven't yet.  */
+#ifndef RE_THREAD_SAFE
+  /* Compile fastmap if we haven't yet.  re_compile_internal already
+     did if the fastmap was given before compiling; a pattern shared
+     between threads must be compiled that way, since the search would
+     write FASTMAP_ACCURATE, a bit-field no lock or barrier covers.  */
   if (start < last_start && bufp->fastmap != NULL && !bufp->fastmap_accurate)
     re_compile_fastmap (bufp);
+#endif
 
   if (BE (bufp->no_sub, 0))
     regs = NULL;
 
+  /* Without registers and length, only the start of the match is
+     returned, so any match starting there will do.  */
+  if (regs == NULL && !ret_len)
+    eflags |= REG_NOLONGEST;
+
   /* We need at least 1 register.  */
   if (regs == NULL)
     nregs = 1;
@@ -480,13 +781,20 @@ re_search_stub (struct re_pattern_buffer *bufp,
 
   /* I hope we needn't fill ther regs with -1's when no match was found.  */
   if (result != REG_NOERROR)
-    rval = -1;
+    rval = BE (result == REG_ELIMIT, 0) ? -3 : -1;
   else if (regs != NULL)
     {
       /* If caller wants register contents data back, copy them.  */
-      bufp->regs_allocated = re_copy_regs (regs, pmatch, nregs,
-					   bufp->regs_allocated);
-      if (BE (bufp->regs_allocated == REGS_UNALLOCATED, 0))
+      unsigned regs_allocated;
+      re_dfa_lock (bufp->buffer);
+      regs_allocated = re_copy_regs (regs, pmatch, nregs,
+				     bufp->regs_allocated);
+      /* REGS_ALLOCATED shares a word with bit-fields that searches read
+	 without the lock, so only store it when it changes (see regex.h).  */
+      if (regs_allocated != bufp->regs_allocated)
+	bufp->regs_allocated = regs_allocated;
+      re_dfa_unlock (bufp->buffer);
+      if (BE (regs_allocated == REGS_UNALLOCATED, 0))
 	rval = -2;
     }
 
@@ -502,7 +810,6 @@ re_search_stub (struct re_pattern_buffer *bufp,
     }
   re_free (pmatch);
  out:
-  __libc_lock_unlock (dfa->lock);
   return rval;
 }
 
@@ -684,6 +991,21 @@ re_search_internal (const regex_t *preg,
   assert (0 <= last_start && last_start <= length);
 #endif
 
+  /* Fixed-length patterns are searched with the bit-parallel matcher.  */
+  if (dfa->shift_and != NULL && start <= last_start && t == NULL
+      && !(preg->syntax & RE_ICASE))
+    return shift_and_search (preg, string, start, last_start, stop, fastmap,
+			     nmatch + extra_nmatch, pmatch);
+
+  /* Runs of a repeated bracket are found directly, unless `^' and `$'
+     can match at newlines or `$' does not match at STOP.  */
+  if (dfa->class_run != NULL && start <= last_start && last_start <= stop
+      && t == NULL && !(preg->syntax & RE_ICASE) && !preg->newline_anchor
+      && (!dfa->class_run->eol
+	  || (stop == length && !(eflags & REG_NOTEOL))))
+    return class_run_search (preg, string, start, last_start, stop,
+			     nmatch + extra_nmatch, pmatch, eflags);
+
   /* If initial states with non-begbuf contexts have no elements,
      the regex must be anchored.  If preg->newline_anchor is set,
      we'll never use init_state_nl, so do not check it.  */
@@ -697,8 +1019,43 @@ re_search_internal (const regex_t *preg,
       start = last_start = 0;
     }
 
-  /* We must check the longest matching, if nmatch > 0.  */
-  fl_longest_match = (nmatch != 0 || dfa->nbackref);
+  /* A leading `.*' matches at START if it matches anywhere after it.  */
+  if (dfa->leading_dot_star && start < last_start)
+    {
+      last_start = start;
+      fastmap = NULL;
+    }
+
+  /* For a pattern `<re>$', run the reversed automaton backward from the
+     end of the input to find the leftmost position where a match can
+     start; no other position needs to be tried.  */
+  if (dfa->rev_dfa != NULL && start <= last_start && stop == length
+      && !preg->newline_anchor && !(eflags & REG_NOTEOL))
+    {
+      Idx rev_start = search_reverse (preg, string, length, start);
+      if (BE (rev_start == REG_ERROR, 0))
+	return REG_ESPACE;
+      if (rev_start == REG_MISSING || rev_start > last_start)
+	return REG_NOMATCH;
+      start = last_start = rev_start;
+      fastmap = NULL;
+    }
+
+  /* We must check the longest matching, if nmatch > 0, unless the
+     caller only wants to know where a match starts.  */
+  fl_longest_match = ((nmatch != 0
+		       && (nmatch > 1 || !(eflags & REG_NOLONGEST)))
+		      || dfa->nbackref);
+
+  /* Give a pattern that keeps being searched a larger flat DFA.  */
+  if (BE (dfa->shift_and == NULL
+	  && load_acquire_int (dfa->nsearches) < FLAT_DFA_HOT_SEARCHES
+	  && hot_dfa_p (dfa), 0))
+    {
+      err = create_flat_dfa ((re_dfa_t *) dfa, FLAT_DFA_HOT_STATES_MAX);
+      if (BE (err != REG_NOERROR, 0))
+	return err;
+    }
 
   err = re_string_allocate (&mctx.input, string, length, dfa->nodes_len + 1,
 			    preg->translate, (preg->syntax & RE_ICASE) != 0,
@@ -777,10 +1134,23 @@ re_search_internal (const regex_t *preg,
 	  goto forward_match_found_start_or_reached_end;
 
 	case 6:
-	  /* Fastmap without translation, match forward.  */
-	  while (BE (match_first < right_lim, 1)
-		 && !fastmap[(unsigned char) string[match_first]])
-	    ++match_first;
+	  /* Fastmap without translation, match forward.  With many literal
+	     prefixes, look for the literals themselves.  */
+	  if (dfa->literals != NULL && dfa->fastmap_nbytes == 0)
+	    {
+	      match_first = skip_to_literal (dfa->literals, string,
+					     match_first, stop);
+	      if (match_first == REG_MISSING || match_first > right_lim)
+		goto free_return;
+	      break;
+	    }
+	  if (dfa->fastmap_nbytes != 0)
+	    match_first = skip_to_fastmap_byte (dfa, fastmap, string,
+						match_first, right_lim);
+	  else
+	    while (BE (match_first < right_lim, 1)
+		   && !fastmap[(unsigned char) string[match_first]])
+	      ++match_first;
 
 	forward_match_found_start_or_reached_end:
 	  if (BE (match_first == right_lim, 0))
@@ -863,7 +1233,8 @@ re_search_internal (const regex_t *preg,
 	{
 	  if (BE (match_last == REG_ERROR, 0))
 	    {
-	      err = REG_ESPACE;
+	      err = ((re_step_limit != 0 && mctx.steps > re_step_limit)
+		     ? REG_ELIMIT : REG_ESPACE);
 	      goto free_return;
 	    }
 	  else
@@ -1120,6 +1491,7 @@ check_matching (re_match_context_t *mctx, bool fl_longest_match,
   Idx match_last = REG_MISSING;
   Idx cur_str_idx = re_string_cur_idx (&mctx->input);
   re_dfastate_t *cur_state;
+  const unsigned short *flat_trans;
   bool at_init_state = p_match_first != NULL;
   Idx next_start_idx = cur_str_idx;
 
@@ -1143,13 +1515,13 @@ check_matching (re_match_context_t *mctx, bool fl_longest_match,
 	  at_init_state = false;
 	  err = check_subexp_matching_top (mctx, &cur_state->nodes, 0);
 	  if (BE (err != REG_NOERROR, 0))
-	    return err;
+	    return REG_ERROR;
 
 	  if (cur_state->has_backref)
 	    {
 	      err = transit_state_bkref (mctx, &cur_state->nodes);
 	      if (BE (err != REG_NOERROR, 0))
-	        return err;
+	        return REG_ERROR;
 	    }
 	}
     }
@@ -1170,6 +1542,48 @@ check_matching (re_match_context_t *mctx, bool fl_longest_match,
 	}
     }
 
+  /* With a DFA determinized at compile time, run its table directly on
+     the input bytes.  */
+  flat_trans = load_acquire (dfa->flat_trans);
+  if (flat_trans != NULL && mctx->state_log == NULL
+      && !mctx->input.mbs_allocated && cur_state == dfa->init_state)
+    {
+      const unsigned char *mbs = mctx->input.mbs;
+      Idx idx = cur_str_idx, stop = mctx->input.stop;
+      unsigned int s = 0, next;
+
+      while (idx < stop)
+	{
+	  next = flat_trans[s * SBC_MAX + mbs[idx++]];
+	  if (next == FLAT_DFA_DEAD)
+	    break;
+	  if (BE (at_init_state, 0))
+	    {
+	      if (next == s)
+		next_start_idx = idx;
+	      else
+		at_init_state = false;
+	    }
+	  s = next;
+	  if (dfa->flat_halt[s])
+	    {
+	      match_last = idx;
+	      p_match_first = NULL;
+	      if (!fl_longest_match)
+		break;
+	      if (dfa->trailing_dot_star)
+		{
+		  match_last = stop;
+		  break;
+		}
+	    }
+	}
+      mctx->input.cur_idx = idx;
+      if (p_match_first)
+	*p_match_first += next_start_idx;
+      return match_last;
+    }
+
   while (!re_string_eoi (&mctx->input))
     {
       re_dfastate_t *old_state = cur_state;
@@ -1229,6 +1643,17 @@ check_matching (re_match_context_t *mctx, bool fl_longest_match,
 	      p_match_first = NULL;
 	      if (!fl_longest_match)
 		break;
+	      if (trailing_dot_star_halt (mctx, cur_state))
+		{
+		  match_last = mctx->input.stop;
+		  break;
+		}
+	    }
+	  else if (trailing_dot_star_halt (mctx, cur_state))
+	    {
+	      match_last = mctx->input.stop;
+	      p_match_first = NULL;
+	      break;
 	    }
 	}
     }
@@ -1239,6 +1664,37 @@ check_matching (re_match_context_t *mctx, bool fl_longest_match,
   return match_last;
 }
 
+/* Return true if the pattern ends with `.*', STATE was reached after
+   the `.*' started and thus the longest match extends to the end of the
+   input: if so, check_matching need not scan the rest of the input.
+   STATE is a halt state; if the pattern ends with `.*$', its END_OF_RE
+   node must be constrained by the `$' alone, which is satisfied at the
+   end of the input.  The state log must not be needed, since it would
+   be left incomplete.  */
+
+static bool
+internal_function
+trailing_dot_star_halt (const re_match_context_t *mctx,
+			const re_dfastate_t *state)
+{
+  const re_dfa_t *const dfa = mctx->dfa;
+  Idx i;
+
+  if (!dfa->trailing_dot_star || mctx->state_log != NULL)
+    return false;
+  if (!dfa->trailing_dot_star_eol)
+    return !state->has_constraint;
+  if ((mctx->eflags & REG_NOTEOL) || mctx->input.stop != mctx->input.len)
+    return false;
+  for (i = 0; i < state->nodes.nelem; ++i)
+    {
+      const re_token_t *node = dfa->nodes + state->nodes.elems[i];
+      if (node->type == END_OF_RE && node->constraint == LINE_LAST)
+	return true;
+    }
+  return false;
+}
+
 /* Check NODE match the current context.  */
 
 static bool
@@ -1443,6 +1899,7 @@ set_regs (const regex_t *preg, const re_match_context_t *mctx, size_t nmatch,
   struct re_fail_stack_t fs_body = { 0, 2, NULL };
   regmatch_t *prev_idx_match;
   bool prev_idx_match_malloced = false;
+  unsigned long int steps = mctx->steps;
 
 #ifdef DEBUG
   assert (nmatch > 1);
@@ -1477,6 +1934,15 @@ set_regs (const regex_t *preg, const re_match_context_t *mctx, size_t nmatch,
 
   for (idx = pmatch[0].rm_so; idx <= pmatch[0].rm_eo ;)
     {
+      /* Backtracking can take exponential time; bound it as well.  */
+      if (fs && BE (re_step_limit != 0 && ++steps > re_step_limit, 0))
+	{
+	  re_node_set_free (&eps_via_nodes);
+	  if (prev_idx_match_malloced)
+	    re_free (prev_idx_match);
+	  free_fail_stack_return (fs);
+	  return REG_ELIMIT;
+	}
       update_regs (dfa, pmatch, prev_idx_match, cur_node, idx, nmatch);
 
       if (idx == pmatch[0].rm_eo && cur_node == mctx->last_node)
@@ -1859,15 +2325,21 @@ add_epsilon_src_nodes (const re_dfa_t *dfa, re_node_set *dest_nodes,
   if (BE (err != REG_NOERROR, 0))
     return err;
 
+  /* STATE may be shared with concurrent searches.  */
+  re_dfa_lock (dfa);
   if (!state->inveclosure.alloc)
     {
       err = re_node_set_alloc (&state->inveclosure, dest_nodes->nelem);
       if (BE (err != REG_NOERROR, 0))
-        return REG_ESPACE;
+	{
+	  re_dfa_unlock (dfa);
+	  return REG_ESPACE;
+	}
       for (i = 0; i < dest_nodes->nelem; i++)
         re_node_set_merge (&state->inveclosure,
 			   dfa->inveclosures + dest_nodes->elems[i]);
     }
+  re_dfa_unlock (dfa);
   return re_node_set_add_intersect (dest_nodes, candidates,
 				    &state->inveclosure);
 }
@@ -2316,11 +2788,11 @@ transit_state (reg_errcode_t *err, re_match_context_t *mctx,
   ch = re_string_fetch_byte (&mctx->input);
   for (;;)
     {
-      trtable = state->trtable;
+      trtable = load_acquire (state->trtable);
       if (BE (trtable != NULL, 1))
 	return trtable[ch];
 
-      trtable = state->word_trtable;
+      trtable = load_acquire (state->word_trtable);
       if (BE (trtable != NULL, 1))
         {
 	  unsigned int context;
@@ -2744,6 +3216,8 @@ get_subexp (re_match_context_t *mctx, Idx bkref_node, Idx bkref_str_idx)
 
       if (dfa->nodes[sub_top->node].opr.idx != subexp_num)
 	continue; /* It isn't related.  */
+      if (BE (step_limit_exceeded (mctx), 0))
+	return REG_ELIMIT;
 
       sl_str = sub_top->str_idx;
       bkref_str_off = bkref_str_idx;
@@ -2800,6 +3274,8 @@ get_subexp (re_match_context_t *mctx, Idx bkref_node, Idx bkref_str_idx)
 	  Idx cls_node;
 	  regoff_t sl_str_off;
 	  const re_node_set *nodes;
+	  if (BE (step_limit_exceeded (mctx), 0))
+	    return REG_ELIMIT;
 	  sl_str_off = sl_str - sub_top->str_idx;
 	  /* The matched string by the sub expression match with the substring
 	     at the back reference?  */
@@ -2831,8 +3307,7 @@ get_subexp (re_match_context_t *mctx, Idx bkref_node, Idx bkref_str_idx)
 	    continue; /* No.  */
 	  if (sub_top->path == NULL)
 	    {
-	      sub_top->path = calloc (sizeof (state_array_t),
-				      sl_str - sub_top->str_idx + 1);
+	      sub_top->path = calloc (1, sizeof (state_array_t));
 	      if (sub_top->path == NULL)
 		return REG_ESPACE;
 	    }
@@ -2909,9 +3384,40 @@ find_subexp_node (const re_dfa_t *dfa, const re_node_set *nodes,
   return REG_MISSING;
 }
 
+/* Make sure that PATH has a slot for every string index up to LAST_IDX.
+   The array grows geometrically, and only from the index the path starts
+   at, so that the many short paths of a back reference search do not each
+   take (and clear) memory proportional to the whole string.  */
+
+static reg_errcode_t
+internal_function
+extend_path (state_array_t *path, Idx last_idx)
+{
+  re_dfastate_t **new_array;
+  Idx old_alloc = path->alloc;
+  Idx new_alloc = last_idx - path->base + 1;
+  if (new_alloc <= old_alloc)
+    return REG_NOERROR;
+  if (new_alloc < 2 * old_alloc)
+    new_alloc = 2 * old_alloc;
+  if (BE (SIZE_MAX / sizeof (re_dfastate_t *) < new_alloc, 0))
+    return REG_ESPACE;
+  new_array = re_realloc (path->array, re_dfastate_t *, new_alloc);
+  if (BE (new_array == NULL, 0))
+    return REG_ESPACE;
+  path->array = new_array;
+  path->alloc = new_alloc;
+  memset (new_array + old_alloc, '\0',
+	  sizeof (re_dfastate_t *) * (new_alloc - old_alloc));
+  return REG_NOERROR;
+}
+
 /* Check whether the node TOP_NODE at TOP_STR can arrive to the node
    LAST_NODE at LAST_STR.  We record the path onto PATH since it will be
-   heavily reused.
+   heavily reused: the states already computed are a memo of where TOP_NODE
+   can get to, and a later query for the same path resumes from where the
+   previous one stopped.  The walk stops as soon as no node is alive, so a
+   path that died is answered without touching the rest of the string.
    Return REG_NOERROR if it can arrive, or REG_NOMATCH otherwise.  */
 
 static reg_errcode_t
@@ -2924,34 +3430,19 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
   Idx subexp_num, backup_cur_idx, str_idx, null_cnt;
   re_dfastate_t *cur_state = NULL;
   re_node_set *cur_nodes, next_nodes;
-  re_dfastate_t **backup_state_log;
   unsigned int context;
 
   subexp_num = dfa->nodes[top_node].opr.idx;
-  /* Extend the buffer if we need.  */
-  if (BE (path->alloc < last_str + mctx->max_mb_elem_len + 1, 0))
-    {
-      re_dfastate_t **new_array;
-      Idx old_alloc = path->alloc;
-      Idx new_alloc = old_alloc + last_str + mctx->max_mb_elem_len + 1;
-      if (BE (new_alloc < old_alloc, 0)
-	  || BE (SIZE_MAX / sizeof (re_dfastate_t *) < new_alloc, 0))
-	return REG_ESPACE;
-      new_array = re_realloc (path->array, re_dfastate_t *, new_alloc);
-      if (BE (new_array == NULL, 0))
-	return REG_ESPACE;
-      path->array = new_array;
-      path->alloc = new_alloc;
-      memset (new_array + old_alloc, '\0',
-	      sizeof (re_dfastate_t *) * (path->alloc - old_alloc));
-    }
-
+  if (path->array == NULL)
+    path->base = top_str;
   str_idx = path->next_idx ? path->next_idx : top_str;
+  /* Extend the buffer if we need.  */
+  err = extend_path (path, str_idx + mctx->max_mb_elem_len + 1);
+  if (BE (err != REG_NOERROR, 0))
+    return err;
 
   /* Temporary modify MCTX.  */
-  backup_state_log = mctx->state_log;
   backup_cur_idx = mctx->input.cur_idx;
-  mctx->state_log = path->array;
   mctx->input.cur_idx = str_idx;
 
   /* Setup initial node set.  */
@@ -2970,7 +3461,7 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
     }
   else
     {
-      cur_state = mctx->state_log[str_idx];
+      cur_state = PATH_STATE (path, str_idx);
       if (cur_state && cur_state->has_backref)
 	{
 	  err = re_node_set_init_copy (&next_nodes, &cur_state->nodes);
@@ -2984,7 +3475,7 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
     {
       if (next_nodes.nelem)
 	{
-	  err = expand_bkref_cache (mctx, &next_nodes, str_idx,
+	  err = expand_bkref_cache (mctx, path, &next_nodes, str_idx,
 				    subexp_num, type);
 	  if (BE (err != REG_NOERROR, 0))
 	    {
@@ -2998,16 +3489,29 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
 	  re_node_set_free (&next_nodes);
 	  return err;
 	}
-      mctx->state_log[str_idx] = cur_state;
+      PATH_STATE (path, str_idx) = cur_state;
     }
 
   for (null_cnt = 0; str_idx < last_str && null_cnt <= mctx->max_mb_elem_len;)
     {
+      if (BE (step_limit_exceeded (mctx), 0))
+	{
+	  re_node_set_free (&next_nodes);
+	  return REG_ELIMIT;
+	}
+      /* A back reference may put a state up to MAX_MB_ELEM_LEN bytes
+	 after the next index.  */
+      err = extend_path (path, str_idx + mctx->max_mb_elem_len + 1);
+      if (BE (err != REG_NOERROR, 0))
+	{
+	  re_node_set_free (&next_nodes);
+	  return err;
+	}
       re_node_set_empty (&next_nodes);
-      if (mctx->state_log[str_idx + 1])
+      if (PATH_STATE (path, str_idx + 1))
 	{
 	  err = re_node_set_merge (&next_nodes,
-				   &mctx->state_log[str_idx + 1]->nodes);
+				   &PATH_STATE (path, str_idx + 1)->nodes);
 	  if (BE (err != REG_NOERROR, 0))
 	    {
 	      re_node_set_free (&next_nodes);
@@ -3016,7 +3520,7 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
 	}
       if (cur_state)
 	{
-	  err = check_arrival_add_next_nodes (mctx, str_idx,
+	  err = check_arrival_add_next_nodes (mctx, path, str_idx,
 					      &cur_state->non_eps_nodes,
 					      &next_nodes);
 	  if (BE (err != REG_NOERROR, 0))
@@ -3034,7 +3538,7 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
 	      re_node_set_free (&next_nodes);
 	      return err;
 	    }
-	  err = expand_bkref_cache (mctx, &next_nodes, str_idx,
+	  err = expand_bkref_cache (mctx, path, &next_nodes, str_idx,
 				    subexp_num, type);
 	  if (BE (err != REG_NOERROR, 0))
 	    {
@@ -3049,16 +3553,16 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
 	  re_node_set_free (&next_nodes);
 	  return err;
 	}
-      mctx->state_log[str_idx] = cur_state;
+      PATH_STATE (path, str_idx) = cur_state;
       null_cnt = cur_state == NULL ? null_cnt + 1 : 0;
     }
   re_node_set_free (&next_nodes);
-  cur_nodes = (mctx->state_log[last_str] == NULL ? NULL
-	       : &mctx->state_log[last_str]->nodes);
+  cur_nodes = (last_str - path->base >= path->alloc
+	       || PATH_STATE (path, last_str) == NULL ? NULL
+	       : &PATH_STATE (path, last_str)->nodes);
   path->next_idx = str_idx;
 
   /* Fix MCTX.  */
-  mctx->state_log = backup_state_log;
   mctx->input.cur_idx = backup_cur_idx;
 
   /* Then check the current node set has the node LAST_NODE.  */
@@ -3078,8 +3582,9 @@ check_arrival (re_match_context_t *mctx, state_array_t *path, Idx top_node,
 
 static reg_errcode_t
 internal_function
-check_arrival_add_next_nodes (re_match_context_t *mctx, Idx str_idx,
-			      re_node_set *cur_nodes, re_node_set *next_nodes)
+check_arrival_add_next_nodes (re_match_context_t *mctx, state_array_t *path,
+			      Idx str_idx, re_node_set *cur_nodes,
+			      re_node_set *next_nodes)
 {
   const re_dfa_t *const dfa = mctx->dfa;
   bool ok;
@@ -3108,7 +3613,7 @@ check_arrival_add_next_nodes (re_match_context_t *mctx, Idx str_idx,
 	      re_dfastate_t *dest_state;
 	      Idx next_node = dfa->nexts[cur_node];
 	      Idx next_idx = str_idx + naccepted;
-	      dest_state = mctx->state_log[next_idx];
+	      dest_state = PATH_STATE (path, next_idx);
 	      re_node_set_empty (&union_set);
 	      if (dest_state)
 		{
@@ -3125,9 +3630,9 @@ check_arrival_add_next_nodes (re_match_context_t *mctx, Idx str_idx,
 		  re_node_set_free (&union_set);
 		  return REG_ESPACE;
 		}
-	      mctx->state_log[next_idx] = re_acquire_state (&err, dfa,
-							    &union_set);
-	      if (BE (mctx->state_log[next_idx] == NULL
+	      PATH_STATE (path, next_idx) = re_acquire_state (&err, dfa,
+							      &union_set);
+	      if (BE (PATH_STATE (path, next_idx) == NULL
 		      && err != REG_NOERROR, 0))
 		{
 		  re_node_set_free (&union_set);
@@ -3257,8 +3762,9 @@ check_arrival_expand_ecl_sub (const re_dfa_t *dfa, re_node_set *dst_nodes,
 
 static reg_errcode_t
 internal_function
-expand_bkref_cache (re_match_context_t *mctx, re_node_set *cur_nodes,
-		    Idx cur_str, Idx subexp_num, int type)
+expand_bkref_cache (re_match_context_t *mctx, state_array_t *path,
+		    re_node_set *cur_nodes, Idx cur_str, Idx subexp_num,
+		    int type)
 {
   const re_dfa_t *const dfa = mctx->dfa;
   reg_errcode_t err;
@@ -3280,7 +3786,7 @@ expand_bkref_cache (re_match_context_t *mctx, re_node_set *cur_nodes,
 
       to_idx = cur_str + ent->subexp_to - ent->subexp_from;
       /* Calculate the destination of the back reference, and append it
-	 to MCTX->STATE_LOG.  */
+	 to PATH.  */
       if (to_idx == cur_str)
 	{
 	  /* The backreference did epsilon transit, we must re-check all the
@@ -3308,14 +3814,14 @@ expand_bkref_cache (re_match_context_t *mctx, re_node_set *cur_nodes,
 	{
 	  re_node_set union_set;
 	  next_node = dfa->nexts[ent->node];
-	  if (mctx->state_log[to_idx])
+	  if (PATH_STATE (path, to_idx))
 	    {
 	      bool ok;
-	      if (re_node_set_contains (&mctx->state_log[to_idx]->nodes,
+	      if (re_node_set_contains (&PATH_STATE (path, to_idx)->nodes,
 					next_node))
 		continue;
 	      err = re_node_set_init_copy (&union_set,
-					   &mctx->state_log[to_idx]->nodes);
+					   &PATH_STATE (path, to_idx)->nodes);
 	      ok = re_node_set_insert (&union_set, next_node);
 	      if (BE (err != REG_NOERROR || ! ok, 0))
 		{
@@ -3330,9 +3836,9 @@ expand_bkref_cache (re_match_context_t *mctx, re_node_set *cur_nodes,
 	      if (BE (err != REG_NOERROR, 0))
 		return err;
 	    }
-	  mctx->state_log[to_idx] = re_acquire_state (&err, dfa, &union_set);
+	  PATH_STATE (path, to_idx) = re_acquire_state (&err, dfa, &union_set);
 	  re_node_set_free (&union_set);
-	  if (BE (mctx->state_log[to_idx] == NULL
+	  if (BE (PATH_STATE (path, to_idx) == NULL
 		  && err != REG_NOERROR, 0))
 	    return err;
 	}
@@ -3341,6 +3847,385 @@ expand_bkref_cache (re_match_context_t *mctx, re_node_set *cur_nodes,
   return REG_NOERROR;
 }
 
+/* If the DFA has at most MAX_STATES states and none of them has
+   constraints, build all of their transition tables now and copy them to
+   DFA->FLAT_TRANS, so that check_matching runs without building tables or
+   checking for them.  Called by re_compile_internal with a small limit,
+   and by re_search_internal with a larger one once the pattern is hot.  */
+
+static reg_errcode_t
+create_flat_dfa (re_dfa_t *dfa, Idx max_states)
+{
+  re_dfastate_t **states;
+  Idx *slots;
+  Idx nstates = 1, nslots = 2 * max_states, i, j;
+  unsigned short *trans, *new_trans;
+  unsigned char *halt;
+  int ch;
+
+  if (dfa->mb_cur_max > 1 || dfa->has_mb_node || dfa->nbackref > 0
+      || dfa->init_state->has_constraint)
+    {
+      store_release_int (dfa->nsearches, FLAT_DFA_HOT_SEARCHES);
+      return REG_NOERROR;
+    }
+
+  /* The table is followed by the halt flags, in one block.  SLOTS is an
+     open hash from the states to their index in STATES.  */
+  trans = (unsigned short *) malloc ((sizeof (unsigned short) * SBC_MAX + 1)
+				     * max_states);
+  states = re_malloc (re_dfastate_t *, max_states);
+  slots = re_malloc (Idx, nslots);
+  if (BE (trans == NULL || states == NULL || slots == NULL, 0))
+    {
+      re_free (trans);
+      re_free (states);
+      re_free (slots);
+      return REG_ESPACE;
+    }
+  for (i = 0; i < nslots; ++i)
+    slots[i] = REG_MISSING;
+  halt = (unsigned char *) (trans + max_states * SBC_MAX);
+
+  states[0] = dfa->init_state;
+  slots[((uintptr_t) states[0] / sizeof (void *)) & (nslots - 1)] = 0;
+  for (i = 0; i < nstates; ++i)
+    {
+      re_dfastate_t *state = states[i];
+      re_dfastate_t **trtable = load_acquire (state->trtable);
+      if (trtable == NULL && load_acquire (state->word_trtable) == NULL)
+	{
+	  if (!build_trtable (dfa, state))
+	    goto espace;
+	  trtable = load_acquire (state->trtable);
+	}
+      if (trtable == NULL)
+	goto give_up;
+
+      halt[i] = state->halt;
+      for (ch = 0; ch < SBC_MAX; ++ch)
+	{
+	  re_dfastate_t *next = trtable[ch];
+	  Idx slot;
+	  if (next == NULL)
+	    {
+	      trans[i * SBC_MAX + ch] = FLAT_DFA_DEAD;
+	      continue;
+	    }
+	  if (next->has_constraint)
+	    goto give_up;
+	  for (slot = ((uintptr_t) next / sizeof (void *)) & (nslots - 1);
+	       (j = slots[slot]) != REG_MISSING && states[j] != next;
+	       slot = (slot + 1) & (nslots - 1))
+	    ;
+	  if (j == REG_MISSING)
+	    {
+	      if (nstates == max_states)
+		goto give_up;
+	      j = slots[slot] = nstates;
+	      states[nstates++] = next;
+	    }
+	  trans[i * SBC_MAX + ch] = j;
+	}
+    }
+
+  /* Move the halt flags down to the end of the part in use, and give back
+     the rest.  */
+  memmove (trans + nstates * SBC_MAX, halt, nstates);
+  new_trans = (unsigned short *) realloc (trans, (sizeof (unsigned short)
+						  * SBC_MAX + 1) * nstates);
+  if (new_trans != NULL)
+    trans = new_trans;
+  dfa->flat_halt = (unsigned char *) (trans + nstates * SBC_MAX);
+  store_release (dfa->flat_trans, trans);
+  store_release_int (dfa->nsearches, FLAT_DFA_HOT_SEARCHES);
+  re_free (states);
+  re_free (slots);
+  return REG_NOERROR;
+
+ give_up:
+  /* Only a DFA that was too big is worth another try when it is hot.  */
+  if (nstates < max_states)
+    store_release_int (dfa->nsearches, FLAT_DFA_HOT_SEARCHES);
+  re_free (trans);
+  re_free (states);
+  re_free (slots);
+  return REG_NOERROR;
+
+ espace:
+  re_free (trans);
+  re_free (states);
+  re_free (slots);
+  return REG_ESPACE;
+}
+
+/* Return true if this search makes the pattern of DFA hot, so that it is
+   time to try create_flat_dfa with the larger limit.  Only the search
+   that reaches the threshold returns true.  The caller checks first that
+   NSEARCHES is below it, so that the lock is only taken while counting.  */
+
+static bool
+internal_function
+hot_dfa_p (const re_dfa_t *dfa)
+{
+  re_dfa_t *hot_dfa = (re_dfa_t *) dfa;
+  unsigned int nsearches;
+  bool hot = false;
+  re_dfa_lock (dfa);
+  nsearches = load_acquire_int (hot_dfa->nsearches);
+  if (nsearches < FLAT_DFA_HOT_SEARCHES)
+    {
+      store_release_int (hot_dfa->nsearches, nsearches + 1);
+      hot = nsearches + 1 == FLAT_DFA_HOT_SEARCHES;
+    }
+  re_dfa_unlock (dfa);
+  return hot;
+}
+
+/* Walk the DFA breadth-first from its initial state, spelling out the
+   strings it can read, and stop each string at a halt state, at a state
+   with constraints, or once there would be too many of them.  Every match
+   then starts with one of the strings where the walk stopped; if none of
+   them is shorter than two bytes, build an Aho-Corasick automaton over
+   them in DFA->LITERALS.  The trie of the walk is the trie of the
+   automaton.  Called by re_compile_internal.  */
+
+static reg_errcode_t
+create_literals (re_dfa_t *dfa)
+{
+  re_dfastate_t **node_state;
+  Idx *node_parent;
+  unsigned char *node_byte, *node_out = NULL;
+  unsigned int *trans = NULL, *fail = NULL;
+  re_literals_t *lits;
+  Idx nnodes = 1, nalloc = LITERALS_MAX + 1, nterminals = 0;
+  Idx level_begin = 0, level_end = 1, depth, max_len, i, j, nclasses;
+  unsigned char classes[SBC_MAX];
+  reg_errcode_t err = REG_NOERROR;
+  int ch;
+
+  if (dfa->mb_cur_max > 1 || dfa->has_mb_node || dfa->nbackref > 0
+      || dfa->init_state->has_constraint)
+    return REG_NOERROR;
+
+  node_state = re_malloc (re_dfastate_t *, nalloc);
+  node_parent = re_malloc (Idx, nalloc);
+  node_byte = re_malloc (unsigned char, nalloc);
+  node_out = (unsigned char *) calloc (nalloc, 1);
+  if (BE (node_state == NULL || node_parent == NULL || node_byte == NULL
+	  || node_out == NULL, 0))
+    goto espace;
+  node_state[0] = dfa->init_state;
+
+  /* NODE_OUT[I] is set to the depth of node I if the walk stops there;
+     a walk that stops at the root is of no use.  */
+  for (depth = 0; level_begin < level_end; ++depth)
+    {
+      Idx nchildren = 0;
+      for (i = level_begin; i < level_end; ++i)
+	{
+	  re_dfastate_t *state = node_state[i];
+	  bool expand = (depth < LITERAL_LEN_MAX && !state->halt
+			 && !state->has_constraint);
+	  if (expand && state->trtable == NULL && state->word_trtable == NULL
+	      && !build_trtable (dfa, state))
+	    goto espace;
+	  if (expand && state->trtable != NULL)
+	    for (ch = 0; ch < SBC_MAX; ++ch)
+	      nchildren += state->trtable[ch] != NULL;
+	  else if (depth == 0)
+	    goto give_up;
+	  else
+	    {
+	      node_out[i] = depth;
+	      ++nterminals;
+	    }
+	}
+
+      /* Stop here if the level below would be too wide.  */
+      if (nterminals + nchildren > LITERALS_MAX)
+	{
+	  if (depth == 0)
+	    goto give_up;
+	  for (i = level_begin; i < level_end; ++i)
+	    if (node_out[i] == 0)
+	      {
+		node_out[i] = depth;
+		++nterminals;
+	      }
+	  break;
+	}
+
+      if (nnodes + nchildren > nalloc)
+	{
+	  re_dfastate_t **new_state;
+	  Idx *new_parent;
+	  unsigned char *new_byte, *new_out;
+	  Idx new_nalloc = 2 * (nnodes + nchildren);
+	  new_state = re_realloc (node_state, re_dfastate_t *, new_nalloc);
+	  if (BE (new_state == NULL, 0))
+	    goto espace;
+	  node_state = new_state;
+	  new_parent = re_realloc (node_parent, Idx, new_nalloc);
+	  if (BE (new_parent == NULL, 0))
+	    goto espace;
+	  node_parent = new_parent;
+	  new_byte = re_realloc (node_byte, unsigned char, new_nalloc);
+	  if (BE (new_byte == NULL, 0))
+	    goto espace;
+	  node_byte = new_byte;
+	  new_out = re_realloc (node_out, unsigned char, new_nalloc);
+	  if (BE (new_out == NULL, 0))
+	    goto espace;
+	  node_out = new_out;
+	  memset (node_out + nalloc, '\0', new_nalloc - nalloc);
+	  nalloc = new_nalloc;
+	}
+
+      for (i = level_begin; i < level_end; ++i)
+	if (node_out[i] == 0)
+	  for (ch = 0; ch < SBC_MAX; ++ch)
+	    if (node_state[i]->trtable[ch] != NULL)
+	      {
+		node_state[nnodes] = node_state[i]->trtable[ch];
+		node_parent[nnodes] = i;
+		node_byte[nnodes] = ch;
+		++nnodes;
+	      }
+      level_begin = level_end;
+      level_end = nnodes;
+    }
+
+  /* A one-byte literal is no better than the fastmap.  */
+  max_len = 0;
+  for (i = 0; i < nnodes; ++i)
+    if (node_out[i] != 0)
+      {
+	if (node_out[i] < 2)
+	  goto give_up;
+	if (max_len < node_out[i])
+	  max_len = node_out[i];
+      }
+
+  /* Class 0 is for the bytes on no edge of the trie; if every byte is
+     on one, the classes do not fit in CLASSES.  */
+  memset (classes, '\0', SBC_MAX);
+  nclasses = 1;
+  for (i = 1; i < nnodes; ++i)
+    if (classes[node_byte[i]] == 0)
+      {
+	if (nclasses > UCHAR_MAX)
+	  goto give_up;
+	classes[node_byte[i]] = nclasses++;
+      }
+
+  trans = re_malloc (unsigned int, nnodes * nclasses);
+  fail = re_malloc (unsigned int, nnodes);
+  if (BE (trans == NULL || fail == NULL, 0))
+    goto espace;
+  for (i = 0; i < nnodes * nclasses; ++i)
+    trans[i] = UINT_MAX;
+  for (i = 1; i < nnodes; ++i)
+    trans[node_parent[i] * nclasses + classes[node_byte[i]]] = i;
+
+  /* The nodes are in breadth-first order, so the failure link of a node
+     is known before its children are visited.  */
+  fail[0] = 0;
+  for (i = 0; i < nnodes; ++i)
+    for (j = 0; j < nclasses; ++j)
+      {
+	unsigned int *next = trans + i * nclasses + j;
+	unsigned int fallback = i == 0 ? 0 : trans[fail[i] * nclasses + j];
+	if (*next == UINT_MAX)
+	  *next = fallback;
+	else
+	  {
+	    fail[*next] = fallback;
+	    if (node_out[*next] < node_out[fallback])
+	      node_out[*next] = node_out[fallback];
+	  }
+      }
+
+  lits = re_malloc (re_literals_t, 1);
+  if (BE (lits == NULL, 0))
+    goto espace;
+  memcpy (lits->classes, classes, SBC_MAX);
+  lits->nclasses = nclasses;
+  lits->trans = trans;
+  lits->out = node_out;
+  lits->max_len = max_len;
+  dfa->literals = lits;
+  trans = NULL;
+  node_out = NULL;
+  goto give_up;
+
+ espace:
+  err = REG_ESPACE;
+ give_up:
+  re_free (node_state);
+  re_free (node_parent);
+  re_free (node_byte);
+  re_free (node_out);
+  re_free (trans);
+  re_free (fail);
+  return err;
+}
+
+/* Return the leftmost position from IDX on where one of the literals of
+   LITS starts and ends before STOP, or REG_MISSING.  Once a literal is
+   found, keep scanning for as long as a longer one could start before
+   it.  */
+
+static Idx
+internal_function
+skip_to_literal (const re_literals_t *lits, const char *string, Idx idx,
+		 Idx stop)
+{
+  const unsigned int *trans = lits->trans;
+  const unsigned char *classes = lits->classes;
+  Idx nclasses = lits->nclasses, found = REG_MISSING;
+  unsigned int s = 0;
+
+  for (; idx < stop; ++idx)
+    {
+      s = trans[s * nclasses + classes[(unsigned char) string[idx]]];
+      if (BE (lits->out[s] != 0, 0))
+	{
+	  Idx lit_start = idx + 1 - lits->out[s];
+	  if (found == REG_MISSING || lit_start < found)
+	    {
+	      found = lit_start;
+	      if (stop > found + lits->max_len - 1)
+		stop = found + lits->max_len - 1;
+	    }
+	}
+    }
+  return found;
+}
+
+/* Attach the transition table TRTABLE to STATE, as its word_trtable if
+   WORD, unless a concurrent search already gave STATE one; the table is
+   filled in completely before it becomes visible to lock-free readers
+   such as transit_state.  */
+
+static void
+internal_function
+publish_trtable (const re_dfa_t *dfa, re_dfastate_t *state,
+		 re_dfastate_t **trtable, bool word)
+{
+  re_dfa_lock (dfa);
+  if (state->trtable == NULL && state->word_trtable == NULL)
+    {
+      if (word)
+	store_release (state->word_trtable, trtable);
+      else
+	store_release (state->trtable, trtable);
+      trtable = NULL;
+    }
+  re_dfa_unlock (dfa);
+  re_free (trtable);
+}
+
 /* Build transition table for the state.
    Return true if successful.  */
 
@@ -3384,9 +4269,6 @@ build_trtable (const re_dfa_t *dfa, re_dfastate_t *state)
   dests_node = dests_alloc->dests_node;
   dests_ch = dests_alloc->dests_ch;
 
-  /* Initialize transiton table.  */
-  state->word_trtable = state->trtable = NULL;
-
   /* At first, group all nodes belonging to `state' into several
      destinations.  */
   ndests = group_nodes_into_DFAstates (dfa, state, dests_node, dests_ch);
@@ -3396,8 +4278,11 @@ build_trtable (const re_dfa_t *dfa, re_dfastate_t *state)
 	free (dests_alloc);
       if (ndests == 0)
 	{
-	  state->trtable = (re_dfastate_t **)
+	  trtable = (re_dfastate_t **)
 	    calloc (sizeof (re_dfastate_t *), SBC_MAX);
+	  if (BE (trtable == NULL, 0))
+	    return false;
+	  publish_trtable (dfa, state, trtable, false);
 	  return true;
 	}
       return false;
@@ -3490,7 +4375,7 @@ out_free:
 	 character, or we are in a single-byte character set so we can
 	 discern by looking at the character code: allocate a
 	 256-entry transition table.  */
-      trtable = state->trtable =
+      trtable =
 	(re_dfastate_t **) calloc (sizeof (re_dfastate_t *), SBC_MAX);
       if (BE (trtable == NULL, 0))
 	goto out_free;
@@ -3521,7 +4406,7 @@ out_free:
 	 by looking at the character code: build two 256-entry
 	 transition tables, one starting at trtable[0] and one
 	 starting at trtable[SBC_MAX].  */
-      trtable = state->word_trtable =
+      trtable =
 	(re_dfastate_t **) calloc (sizeof (re_dfastate_t *), 2 * SBC_MAX);
       if (BE (trtable == NULL, 0))
 	goto out_free;
@@ -3561,6 +4446,8 @@ out_free:
 	  }
     }
 
+  publish_trtable (dfa, state, trtable, need_word_trtable);
+
   if (dest_states_malloced)
     free (dest_states);
 
@@ -748,22 +748,21 @@ struct sed_label* list_head;
 	return ret;
 }
 
-static struct replacement* new_replacement P_((char*, size_t,
-	enum replacement_types));
+static struct replacement* new_replacement P_((struct subst*, char*,
+	size_t, enum replacement_types));
 static struct replacement*
-new_replacement(text, length, type)
+new_replacement(sub, text, length, type)
+struct subst* sub;
 char* text;
 size_t length;
 enum replacement_types type;
 {
-	struct replacement* r = OB_MALLOC(&obs, 1, struct replacement);
+	struct replacement* r = sub->replacement + sub->repl_count++;
 
 	r->prefix = text;
 	r->prefix_length = length;
 	r->subst_id = -1;
 	r->repl_type = type;
-
-	/* r-> next = NULL; */
 	return r;
 }
 
@@ -778,23 +777,29 @@ size_t length;
 	char* p;
 	char* text_end;
 	enum replacement_types repl_type = REPL_ASIS, save_type = REPL_ASIS;
-	struct replacement root;
 	struct replacement* tail;
+	size_t i, steps = 1;
 
 	sub->max_id = 0;
 	base = MEMDUP(text, length, char);
 	length = normalize_text(base, length, TEXT_REPLACEMENT);
 
+	/* Each backslash or ampersand ends at most one step of the
+	   replacement, and the text after the last one is another. */
 	text_end = base + length;
-	tail = &root;
+	for (p = base; p < text_end; ++p)
+		if (*p == '\\' || *p == '&')
+			++steps;
+	sub->replacement = OB_MALLOC(&obs, steps, struct replacement);
+	sub->repl_count = 0;
 
 	for (p = base; p < text_end; ++p)
 	{
 		if (*p == '\\')
 		{
 			/* Preceding the backslash may be some literal text: */
-			tail = tail->next =
-				new_replacement(base, CAST(size_t)(p - base), repl_type);
+			tail = new_replacement(sub, base, CAST(size_t)(p - base),
+				repl_type);
 
 			repl_type = save_type;
 
@@ -855,8 +860,8 @@ size_t length;
 		else if (*p == '&')
 		{
 			/* Preceding the ampersand may be some literal text: */
-			tail = tail->next =
-				new_replacement(base, CAST(size_t)(p - base), repl_type);
+			tail = new_replacement(sub, base, CAST(size_t)(p - base),
+				repl_type);
 
 			repl_type = save_type;
 			tail->subst_id = 0;
@@ -865,11 +870,19 @@ size_t length;
 	}
 	/* There may be some trailing literal text: */
 	if (base < text_end)
-		tail = tail->next =
-		new_replacement(base, CAST(size_t)(text_end - base), repl_type);
+		new_replacement(sub, base, CAST(size_t)(text_end - base), repl_type);
 
-	tail->next = NULL;
-	sub->replacement = root.next;
+	/* Precompute what each match needs from the steps. */
+	sub->repl_length = 0;
+	sub->repl_modified = false;
+	for (i = 0; i < sub->repl_count; i++)
+	{
+		sub->repl_length += sub->replacement[i].prefix_length;
+		if (sub->replacement[i].repl_type != REPL_ASIS)
+			sub->repl_modified = true;
+	}
+	if (sub->repl_count == 0)
+		sub->replacement = NULL;
 }
 
 static void read_text P_((struct text_buf* buf, int leadin_ch));
@@ -1275,6 +1288,7 @@ struct vector* vector;
 				bad_prog(_(UNTERM_S_CMD));
 
 			cur_cmd->x.cmd_subst = OB_MALLOC(&obs, 1, struct subst);
+			cur_cmd->x.cmd_subst->fused = NULL;
 			setup_replacement(cur_cmd->x.cmd_subst,
 				get_buffer(b2), size_buffer(b2));
 			free_buffer(b2);
@@ -1621,6 +1635,149 @@ const char* cmdfile;
 	return ret;
 }
 
+/* If CMD is an unaddressed s///g command which replaces one literal
+   byte with fixed text, return that byte; otherwise return -1. */
+static int fused_byte P_((const struct sed_cmd* cmd));
+static int
+fused_byte(cmd)
+const struct sed_cmd* cmd;
+{
+	const struct subst* sub = cmd->x.cmd_subst;
+	const struct regex* re;
+	size_t i;
+
+	if (cmd->cmd != 's' || cmd->a1 || cmd->addr_bang)
+		return -1;
+	if (!sub->global || sub->numb > 1 || sub->print || sub->eval
+		|| sub->outf || sub->repl_modified)
+		return -1;
+	for (i = 0; i < sub->repl_count; i++)
+		if (sub->replacement[i].subst_id > 0)
+			return -1;
+
+	re = sub->regx;
+	if (!re || re->flags)
+		return -1;
+	if (re->sz == 1 && !strchr(".[\\*^$+?(){}|", re->re[0]))
+		return (unsigned char)re->re[0];
+	if (re->sz == 2 && re->re[0] == '\\' && re->re[1] != '\0'
+		&& strchr(".[*^$\\", re->re[1]))
+		return (unsigned char)re->re[1];
+	return -1;
+}
+
+/* Can the replacement of SUB produce the byte C? */
+static bool replacement_has_byte P_((const struct subst* sub, int c));
+static bool
+replacement_has_byte(sub, c)
+const struct subst* sub;
+int c;
+{
+	size_t i;
+
+	for (i = 0; i < sub->repl_count; i++)
+		if (memchr(sub->replacement[i].prefix, c,
+			sub->replacement[i].prefix_length))
+			return true;
+	return false;
+}
+
+/* Does any command of PROGRAM use the empty regex, which stands for
+   the last one matched? */
+static bool uses_empty_regex P_((const struct vector* program));
+static bool
+uses_empty_regex(program)
+const struct vector* program;
+{
+	const struct sed_cmd* cmd;
+	const struct sed_cmd* end = program->v + program->v_length;
+
+	for (cmd = program->v; cmd < end; cmd++)
+	{
+		if (cmd->a1 && cmd->a1->addr_type == ADDR_IS_REGEX
+			&& !cmd->a1->addr_regex)
+			return true;
+		if (cmd->a2 && cmd->a2->addr_type == ADDR_IS_REGEX
+			&& !cmd->a2->addr_regex)
+			return true;
+		if (cmd->cmd == 's' && !cmd->x.cmd_subst->regx)
+			return true;
+	}
+	return false;
+}
+
+/* Fold each run of consecutive s///g commands on distinct single bytes,
+   such as s/&/\&amp;/g;s/</\&lt;/g, into its first command, which then
+   rewrites all those bytes in one scan; the rest become no-ops.  This
+   gives the same output as long as no command matches text that an
+   earlier one inserted.  The folded commands would no longer set the
+   regex that // repeats, so scripts using it are left alone. */
+static void fuse_substitutions P_((struct vector* program));
+static void
+fuse_substitutions(program)
+struct vector* program;
+{
+	struct sed_cmd* v = program->v;
+	size_t i, j, k;
+	char used[256];
+
+	if (uses_empty_regex(program))
+		return;
+
+	for (i = 0; i < program->v_length; i = j > i + 1 ? j : i + 1)
+	{
+		struct byte_subst* fused;
+
+		memset(used, 0, sizeof used);
+		for (j = i; j < program->v_length; j++)
+		{
+			int c = fused_byte(v + j);
+			if (c < 0 || used[c])
+				break;
+			for (k = i; k < j; k++)
+				if (replacement_has_byte(v[k].x.cmd_subst, c))
+					break;
+			if (k < j)
+				break;
+			used[c] = 1;
+		}
+		if (j - i < 2)
+			continue;
+
+		fused = OB_MALLOC(&obs, 1, struct byte_subst);
+		memset(fused, 0, sizeof *fused);
+		fused->in_place = true;
+		for (k = i; k < j; k++)
+		{
+			struct subst* sub = v[k].x.cmd_subst;
+			int c = fused_byte(v + k);
+			size_t n, length = sub->repl_length;
+			char* text;
+
+			for (n = 0; n < sub->repl_count; n++)
+				if (sub->replacement[n].subst_id == 0)
+					length++;
+
+			text = OB_MALLOC(&obs, length + 1, char);
+			fused->text[c] = text;
+			fused->length[c] = length;
+			if (length != 1)
+				fused->in_place = false;
+			for (n = 0; n < sub->repl_count; n++)
+			{
+				struct replacement* r = sub->replacement + n;
+				MEMCPY(text, r->prefix, r->prefix_length);
+				text += r->prefix_length;
+				if (r->subst_id == 0)
+					*text++ = c;
+			}
+			if (k > i)
+				v[k].cmd = '#';
+		}
+		v[i].x.cmd_subst->fused = fused;
+	}
+}
+
 /* Make any checks which require the whole program to have been read.
    In particular: this backpatches the jump targets.
    Any cleanup which can be done after these checks is done here also.  */
@@ -1672,6 +1829,9 @@ struct vector* program;
 		;
 	labels = NULL;
 
+	if (program)
+		fuse_substitutions(program);
+
 	/* There is no longer a need to track file names: */
 	{
 		struct output* p;
@@ -19,6 +19,12 @@
 #undef EXPERIMENTAL_DASH_N_OPTIMIZATION	/*don't use -- is very buggy*/
 #define INITIAL_BUFFER_SIZE	50
 #define FREAD_BUFFER_SIZE	8192
+/* The least room made in a line for each read of a command's output. */
+#define PIPE_READ_SIZE		65536
+/* An s command whose first DENSE_SPANS replacements are less than
+   DENSE_SPAN_BYTES apart on average stops editing the line in place. */
+#define DENSE_SPANS		256
+#define DENSE_SPAN_BYTES	32
 
 #include "sed.h"
 
@@ -82,6 +88,11 @@ extern int errno;
 #include <sys/stat.h>
 #include "stat-macros.h"
 
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define USE_SSE2 1
+#endif
+
 
 /* Sed operates a line at a time. */
 struct line {
@@ -160,9 +171,20 @@ static struct line line;
 /* An input line used to accumulate the result of the s and e commands. */
 static struct line s_accum;
 
+/* For each match replaced by an s command, its start and end offsets
+   and the offset in s_accum of the end of its replacement, so that the
+   replacements can be spliced into the pattern space once they are all
+   known. */
+static size_t* subst_spans = NULL;
+static size_t subst_spans_alloc = 0;
+
 /* An input line that's been stored by later use by the program */
 static struct line hold;
 
+/* Set by 'h': the hold space should be a copy of the pattern space,
+   which is not made until a command changes either of them.  */
+static bool hold_pending = false;
+
 /* The buffered input look-ahead.  The only field that should be
    used outside of read_mem_line() or line_init() is buffer.length. */
 static struct line buffer;
@@ -207,7 +229,7 @@ resize_line(lb, len)
 struct line* lb;
 size_t len;
 {
-    int inactive;
+    size_t inactive;
     inactive = lb->active - lb->text;
 
     /* If the inactive part has got to more than two thirds of the buffer,
@@ -233,21 +255,15 @@ size_t len;
     lb->active = lb->text + inactive;
 }
 
-/* Append 'length' bytes from 'string' to the line 'to'. */
-static void str_append P_((struct line*, const char*, size_t));
+/* Update the multibyte state of the line 'to' past 'length' bytes from
+   'string', which were just appended to it. */
+static void str_track_mbstate P_((struct line*, const char*, size_t));
 static void
-str_append(to, string, length)
+str_track_mbstate(to, string, length)
 struct line* to;
 const char* string;
 size_t length;
 {
-    size_t new_length = to->length + length;
-
-    if (to->alloc < new_length)
-        resize_line(to, new_length);
-    MEMCPY(to->active + to->length, string, length);
-    to->length = new_length;
-
 #ifdef HAVE_MBRTOWC
     if (mb_cur_max > 1 && !is_utf8)
         while (length)
@@ -272,6 +288,185 @@ size_t length;
 #endif
 }
 
+/* Append 'length' bytes from 'string' to the line 'to'. */
+static void str_append P_((struct line*, const char*, size_t));
+static void
+str_append(to, string, length)
+struct line* to;
+const char* string;
+size_t length;
+{
+    size_t new_length = to->length + length;
+
+    if (to->alloc < new_length)
+        resize_line(to, new_length);
+    MEMCPY(to->active + to->length, string, length);
+    to->length = new_length;
+    str_track_mbstate(to, string, length);
+}
+
+#ifdef HAVE_POPEN
+/* Append everything the command read by 'pipe_fp' writes to the line
+   'to', reading straight into its buffer. */
+static void str_append_pipe P_((struct line*, FILE*));
+static void
+str_append_pipe(to, pipe_fp)
+struct line* to;
+FILE* pipe_fp;
+{
+    size_t n;
+
+    do
+    {
+        if (to->alloc - to->length < PIPE_READ_SIZE)
+            resize_line(to, to->length + PIPE_READ_SIZE);
+        n = fread(to->active + to->length, sizeof(char),
+            to->alloc - to->length, pipe_fp);
+        str_track_mbstate(to, to->active + to->length, n);
+        to->length += n;
+    } while (n > 0);
+}
+#endif
+
+#ifdef HAVE_MBRTOWC
+/* Case conversion tables, built the first time they are needed.
+   case_map[1][c] and case_map[0][c] are the upper and lower case of the
+   byte c, if case_simple[c] says that c is a character whose case is
+   again a single byte.  utf8_case_map does the same for the characters
+   U+0080 to U+07FF in UTF-8, which are Latin, Greek, Cyrillic and a few
+   more scripts; 0 means there is no mapping that fits.  */
+static bool case_tables_ready = false;
+static bool ascii_case_standard;	/* are ASCII letters mapped as in C? */
+static bool case_simple[256];
+static unsigned char case_map[2][256];
+static unsigned short utf8_case_map[2][0x800 - 0x80];
+
+static void init_case_tables P_((void));
+static void
+init_case_tables()
+{
+    int c, upper;
+
+    ascii_case_standard = true;
+    for (c = 0; c < 256; c++)
+    {
+        char ch = c, out[2];
+        mbstate_t state;
+        wchar_t wc;
+
+        memset(&state, 0, sizeof(state));
+        if ((mb_cur_max == 1 || c < 0x80)
+            && MBRTOWC(&wc, &ch, 1, &state) == 1)
+        {
+            case_simple[c] = true;
+            for (upper = 0; upper < 2; upper++)
+            {
+                wchar_t mapped = upper ? towupper(wc) : towlower(wc);
+
+                memset(&state, 0, sizeof(state));
+                if (WCRTOMB(out, mapped, &state) == 1)
+                    case_map[upper][c] = out[0];
+                else
+                    case_simple[c] = false;
+            }
+        }
+
+        if (c < 0x80
+            && (!case_simple[c]
+                || case_map[1][c] != (c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c)
+                || case_map[0][c] != (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c)))
+            ascii_case_standard = false;
+    }
+
+    if (is_utf8)
+        for (c = 0x80; c < 0x800; c++)
+            for (upper = 0; upper < 2; upper++)
+            {
+                wint_t mapped = upper ? towupper(c) : towlower(c);
+                utf8_case_map[upper][c - 0x80] = mapped < 0x10000 ? mapped : 0;
+            }
+
+    case_tables_ready = true;
+}
+
+/* Append to 'to' the longest prefix of the 'length' bytes at 'string'
+   whose characters are in the case tables, converted to upper case if
+   'upper', or only its first character if 'one'.  Return the number of
+   bytes converted.  There must be room for them at the end of 'to'. */
+static size_t convert_case_run P_((struct line*, const char*, size_t, int,
+    int));
+static size_t
+convert_case_run(to, string, length, upper, one)
+struct line* to;
+const char* string;
+size_t length;
+int upper;
+int one;
+{
+    const unsigned char* p = (const unsigned char*) string;
+    const unsigned char* end = p + length;
+    const unsigned char* map = case_map[upper];
+    unsigned char* out = (unsigned char*) to->active + to->length;
+
+#ifdef USE_SSE2
+    /* Sixteen ASCII bytes at a time: flip bit 5 of the letters. */
+    if (!one && ascii_case_standard)
+    {
+        __m128i first = _mm_set1_epi8((char) ((upper ? 'a' : 'A') + 128));
+        __m128i limit = _mm_set1_epi8((char) (-128 + 26));
+        __m128i bit = _mm_set1_epi8(0x20);
+
+        for (; end - p >= 16; p += 16, out += 16)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+            __m128i letters;
+
+            if (_mm_movemask_epi8(chunk))
+                break;
+            letters = _mm_cmplt_epi8(_mm_sub_epi8(chunk, first), limit);
+            chunk = _mm_xor_si128(chunk, _mm_and_si128(letters, bit));
+            _mm_storeu_si128((__m128i*) out, chunk);
+        }
+    }
+#endif
+
+    while (p < end)
+    {
+        unsigned int wc;
+
+        if (case_simple[*p])
+            *out++ = map[*p++];
+        else if (is_utf8 && (*p & 0xe0) == 0xc0 && *p >= 0xc2
+            && end - p >= 2 && (p[1] & 0xc0) == 0x80
+            && (wc = utf8_case_map[upper][((*p & 0x1f) << 6
+                    | (p[1] & 0x3f)) - 0x80]) != 0)
+        {
+            p += 2;
+            if (wc < 0x80)
+                *out++ = wc;
+            else if (wc < 0x800)
+            {
+                *out++ = 0xc0 | (wc >> 6);
+                *out++ = 0x80 | (wc & 0x3f);
+            }
+            else
+            {
+                *out++ = 0xe0 | (wc >> 12);
+                *out++ = 0x80 | ((wc >> 6) & 0x3f);
+                *out++ = 0x80 | (wc & 0x3f);
+            }
+        }
+        else
+            break;
+        if (one)
+            break;
+    }
+
+    to->length = (char*) out - to->active;
+    return (const char*) p - string;
+}
+#endif
+
 static void str_append_modified P_((struct line*, const char*, size_t,
     enum replacement_types));
 static void
@@ -293,17 +488,57 @@ enum replacement_types type;
     if (to->alloc - to->length < length * mb_cur_max)
         resize_line(to, to->length + length * mb_cur_max);
 
+    /* Without shift states, characters that have an entry in the case
+       tables are converted without going through wide characters. */
+    if (!case_tables_ready && (mb_cur_max == 1 || is_utf8))
+        init_case_tables();
+
     MEMCPY(&from_stat, &to->mbstate, sizeof(mbstate_t));
     while (length)
     {
         wchar_t wc;
-        int n = MBRTOWC(&wc, string, length, &from_stat);
+        int n;
+
+        if (case_tables_ready && (mb_cur_max == 1 || is_utf8))
+        {
+            int first = (type & REPL_MODIFIERS) != 0;
+            size_t done = convert_case_run(to, string, length,
+                first ? (type & REPL_UPPERCASE_FIRST) != 0
+                      : (type & REPL_UPPERCASE) != 0,
+                first);
 
-        /* An invalid sequence is treated like a singlebyte character. */
+            if (done > 0)
+            {
+                string += done, length -= done;
+                if (first)
+                {
+                    type &= ~REPL_MODIFIERS;
+                    if (type == REPL_ASIS)
+                    {
+                        str_append(to, string, length);
+                        return;
+                    }
+                }
+                continue;
+            }
+        }
+
+        n = MBRTOWC(&wc, string, length, &from_stat);
+
+        /* An invalid sequence is treated like a singlebyte character,
+           which has no case to convert. */
         if (n == -1)
         {
-            memset(&to->mbstate, 0, sizeof(from_stat));
-            n = 1;
+            memset(&from_stat, 0, sizeof(from_stat));
+            to->active[to->length++] = *string++;
+            length--;
+            type &= ~REPL_MODIFIERS;
+            if (type == REPL_ASIS)
+            {
+                str_append(to, string, length);
+                return;
+            }
+            continue;
         }
 
         if (n > 0)
@@ -472,6 +707,10 @@ struct line* from;
 struct line* to;
 int state;
 {
+    /* Make room for both pieces at once, so that appending them
+       reallocates the buffer at most once. */
+    if (to->alloc < to->length + 1 + from->length)
+        resize_line(to, to->length + 1 + from->length);
     str_append(to, "\n", 1);
     str_append(to, from->active, from->length);
     to->chomped = from->chomped;
@@ -508,6 +747,48 @@ int state;
 }
 
 
+/* Make the copy of the pattern space that 'h' left pending.  If the
+   pattern space is about to be discarded, the hold space just takes
+   its buffer. */
+static void copy_pending_hold P_((int discard));
+static void
+copy_pending_hold(discard)
+int discard;
+{
+    if (discard)
+    {
+        line_exchange(&line, &hold, false);
+#ifdef HAVE_MBRTOWC
+        MEMCPY(&hold.mbstate, &line.mbstate, sizeof(line.mbstate));
+#endif
+    }
+    else
+        line_copy(&line, &hold, true);
+    hold_pending = false;
+}
+
+/* Can the command 'cmd' run while the copy made by 'h' is pending?
+   It must neither use the hold space nor change the pattern space,
+   except by starting the next cycle.  's' copies the hold space
+   itself once it finds a match. */
+static bool keeps_hold_pending P_((int cmd));
+static bool
+keeps_hold_pending(cmd)
+int cmd;
+{
+    switch (cmd)
+    {
+    case '{': case '}': case '#': case ':': case '=':
+    case 'a': case 'b': case 'd': case 'h': case 'i': case 'l': case 'L':
+    case 'n': case 'p': case 'P': case 'q': case 'Q': case 'r': case 'R':
+    case 's': case 't': case 'T': case 'w': case 'W':
+        return true;
+    default:
+        return false;
+    }
+}
+
+
 /* dummy function to simplify read_pattern_space() */
 static bool read_always_fail P_((struct input*));
 static bool
@@ -583,6 +864,19 @@ struct output* outf;
     flush_output(outf->fp);
 }
 
+/* Output the first line of the pattern space, which ends at the
+   newline 'nl', writing the newline along with it. */
+static void output_first_line P_((const char*, struct output*));
+static void
+output_first_line(nl, outf)
+const char* nl;
+struct output* outf;
+{
+    output_missing_newline(outf);
+    ck_fwrite(line.active, 1, nl + 1 - line.active, outf->fp);
+    flush_output(outf->fp);
+}
+
 static struct append_queue* next_append_slot P_((void));
 static struct append_queue*
 next_append_slot()
@@ -868,7 +1162,11 @@ int append;
         dump_append_queue();
     replaced = false;
     if (!append)
+    {
+        if (hold_pending)
+            copy_pending_hold(true);
         line.length = 0;
+    }
     line.chomped = true;  /* default, until proved otherwise */
 
     while (!(*input->read_fn)(input))
@@ -1127,17 +1425,49 @@ int line_len;
     }
 
 
-static enum replacement_types append_replacement P_((struct line*, struct replacement*,
+static enum replacement_types append_replacement P_((struct line*, struct subst*,
     struct re_registers*,
     enum replacement_types));
 static enum replacement_types
-append_replacement(buf, p, regs, repl_mod)
+append_replacement(buf, sub, regs, repl_mod)
 struct line* buf;
-struct replacement* p;
+struct subst* sub;
 struct re_registers* regs;
 enum replacement_types repl_mod;
 {
-    for (; p; p = p->next)
+    struct replacement* p;
+    struct replacement* end = sub->replacement + sub->repl_count;
+
+    /* Without case conversion or shift states to keep track of, make
+       room for the whole replacement once and copy the steps into it. */
+    if (!sub->repl_modified && (mb_cur_max == 1 || is_utf8))
+    {
+        size_t length = sub->repl_length;
+        char* dst;
+
+        for (p = sub->replacement; p < end; p++)
+            if (0 <= p->subst_id)
+                length += regs->end[p->subst_id] - regs->start[p->subst_id];
+        if (buf->alloc - buf->length < length)
+            resize_line(buf, buf->length + length);
+
+        dst = buf->active + buf->length;
+        for (p = sub->replacement; p < end; p++)
+        {
+            MEMCPY(dst, p->prefix, p->prefix_length);
+            dst += p->prefix_length;
+            if (0 <= p->subst_id)
+            {
+                size_t n = regs->end[p->subst_id] - regs->start[p->subst_id];
+                MEMCPY(dst, line.active + regs->start[p->subst_id], n);
+                dst += n;
+            }
+        }
+        buf->length += length;
+        return repl_mod;
+    }
+
+    for (p = sub->replacement; p < end; p++)
     {
         int i = p->subst_id;
         enum replacement_types curr_type;
@@ -1175,6 +1505,147 @@ enum replacement_types repl_mod;
     return repl_mod;
 }
 
+/* Replace the 'nspans' matches recorded in subst_spans with their
+   replacements, which are stored one after the other in s_accum, or
+   are all 'fixed' if it is not NULL. */
+static void apply_subst_spans P_((size_t, const char*));
+static void
+apply_subst_spans(nspans, fixed)
+size_t nspans;
+const char* fixed;
+{
+    size_t removed = 0, src, dst, end, repl_start, i;
+    size_t new_length;
+    bool left = false;
+
+    /* The text after each match moves by the change in length of the
+       matches up to it.  Moving the pieces that go left front to back,
+       then those that go right back to front, never overwrites a piece
+       that has not been moved yet.  The replacements go in the gaps
+       between the pieces in the second pass, where each gap lies after
+       every piece that is still to be moved. */
+    for (i = 0; i < nspans; i++)
+    {
+        removed += subst_spans[3 * i + 1] - subst_spans[3 * i];
+        if (removed > subst_spans[3 * i + 2])
+            left = true;
+    }
+    new_length = line.length - removed + subst_spans[3 * nspans - 1];
+    if (line.alloc < new_length)
+        resize_line(&line, new_length);
+
+    if (left)
+    {
+        size_t shift = 0;
+        for (i = 0; i < nspans; i++)
+        {
+            src = subst_spans[3 * i + 1];
+            shift += src - subst_spans[3 * i];
+            dst = src - shift + subst_spans[3 * i + 2];
+            end = i + 1 < nspans ? subst_spans[3 * i + 3] : line.length;
+            if (dst < src)
+                MEMMOVE(line.active + dst, line.active + src, end - src);
+        }
+    }
+
+    end = line.length;
+    for (i = nspans; i-- > 0; )
+    {
+        src = subst_spans[3 * i + 1];
+        dst = src - removed + subst_spans[3 * i + 2];
+        if (dst > src)
+            MEMMOVE(line.active + dst, line.active + src, end - src);
+        end = subst_spans[3 * i];
+        removed -= src - end;
+        repl_start = i > 0 ? subst_spans[3 * i - 1] : 0;
+        MEMCPY(line.active + end - removed + repl_start,
+            fixed ? fixed : s_accum.active + repl_start,
+            subst_spans[3 * i + 2] - repl_start);
+    }
+    line.length = new_length;
+}
+
+/* Turn the 'nspans' replacements recorded in subst_spans, which are
+   stored one after the other in s_accum, into the result of the s
+   command up to offset 'start' of the line, as if it had been built by
+   copying it piece by piece.  The replacements only move to the right,
+   so this is done back to front. */
+static void unsplice_subst_spans P_((size_t, size_t));
+static void
+unsplice_subst_spans(nspans, start)
+size_t nspans;
+size_t start;
+{
+    size_t removed = 0, dst, end, repl_start, i;
+
+    for (i = 0; i < nspans; i++)
+        removed += subst_spans[3 * i + 1] - subst_spans[3 * i];
+    dst = start - removed + s_accum.length;
+    if (s_accum.alloc < dst)
+        resize_line(&s_accum, dst);
+    s_accum.length = dst;
+
+    end = start;
+    for (i = nspans; i-- > 0; )
+    {
+        dst -= end - subst_spans[3 * i + 1];
+        MEMCPY(s_accum.active + dst, line.active + subst_spans[3 * i + 1],
+            end - subst_spans[3 * i + 1]);
+        repl_start = i > 0 ? subst_spans[3 * i - 1] : 0;
+        dst -= subst_spans[3 * i + 2] - repl_start;
+        MEMMOVE(s_accum.active + dst, s_accum.active + repl_start,
+            subst_spans[3 * i + 2] - repl_start);
+        end = subst_spans[3 * i];
+    }
+    MEMCPY(s_accum.active, line.active, end);
+}
+
+/* Rewrite the bytes of the line replaced by a run of fused s///g
+   commands, all in one scan. */
+static void do_byte_subst P_((const struct byte_subst*));
+static void
+do_byte_subst(fused)
+const struct byte_subst* fused;
+{
+    char* const* text = fused->text;
+    unsigned char* p = (unsigned char*)line.active;
+    unsigned char* end = p + line.length;
+    unsigned char* from;
+
+    while (p < end && !text[*p])
+        ++p;
+    if (p == end)
+        return;
+
+    if (hold_pending)
+        copy_pending_hold(false);
+
+    /* We found a match, set the 'replaced' flag. */
+    replaced = true;
+
+    if (fused->in_place && (mb_cur_max == 1 || is_utf8))
+    {
+        for (; p < end; ++p)
+            if (text[*p])
+                *p = *text[*p];
+        return;
+    }
+
+    line_reset(&s_accum, &line);
+    from = (unsigned char*)line.active;
+    do
+    {
+        str_append(&s_accum, (char*)from, p - from);
+        str_append(&s_accum, text[*p], fused->length[*p]);
+        from = ++p;
+        while (p < end && !text[*p])
+            ++p;
+    } while (p < end);
+    str_append(&s_accum, (char*)from, end - from);
+    s_accum.chomped = line.chomped;
+    line_exchange(&line, &s_accum, false);
+}
+
 static void do_subst P_((struct subst*));
 static void
 do_subst(sub)
@@ -1184,9 +1655,19 @@ struct subst* sub;
     size_t last_end = 0;  /* where did the last successful match end in LINE */
     countT count = 0;	/* number of matches found */
     bool again = true;
+    bool splice;	/* edit the line in place? */
+    size_t nspans = 0;
+    struct replacement* repl = sub->replacement;
+    const char* fixed = NULL;	/* the replacement, if it is constant */
 
     static struct re_registers regs;
 
+    if (sub->fused)
+    {
+        do_byte_subst(sub->fused);
+        return;
+    }
+
     line_reset(&s_accum, &line);
 
     /* The first part of the loop optimizes s/xxx// when xxx is at the
@@ -1195,6 +1676,9 @@ struct subst* sub;
         &regs, sub->max_id + 1))
         return;
 
+    if (hold_pending)
+        copy_pending_hold(false);
+
     if (!sub->replacement && sub->numb <= 1)
     {
         if (regs.start[0] == 0 && !sub->global)
@@ -1217,6 +1701,17 @@ struct subst* sub;
         }
     }
 
+    /* Unless the encoding has shift states, which are tracked through
+       the whole of s_accum, only the replacements go to s_accum.  They
+       are spliced into the line after all the matches are found, since
+       each search needs the text before it unchanged. */
+    splice = mb_cur_max == 1 || is_utf8;
+    if (!repl)
+        fixed = "";
+    else if (sub->repl_count == 1 && repl->subst_id == -1
+        && !sub->repl_modified)
+        fixed = repl->prefix;
+
     do
     {
         enum replacement_types repl_mod = 0;
@@ -1225,7 +1720,7 @@ struct subst* sub;
         size_t matched = regs.end[0] - regs.start[0];
 
         /* Copy stuff to the left of this match into the output string. */
-        if (start < offset)
+        if (start < offset && !splice)
             str_append(&s_accum, line.active + start, offset - start);
 
         /* If we're counting up to the Nth match, are we there yet?
@@ -1244,7 +1739,23 @@ struct subst* sub;
             replaced = true;
 
             /* Now expand the replacement string into the output string. */
-            repl_mod = append_replacement(&s_accum, sub->replacement, &regs, repl_mod);
+            if (!splice || !fixed)
+                repl_mod = append_replacement(&s_accum, sub, &regs, repl_mod);
+            if (splice)
+            {
+                if (subst_spans_alloc < 3 * (nspans + 1))
+                {
+                    subst_spans_alloc = 2 * subst_spans_alloc + 48;
+                    subst_spans = REALLOC(subst_spans, subst_spans_alloc,
+                        size_t);
+                }
+                subst_spans[3 * nspans] = offset;
+                subst_spans[3 * nspans + 1] = regs.end[0];
+                subst_spans[3 * nspans + 2] = fixed
+                    ? (nspans + 1) * sub->repl_length
+                    : s_accum.length;
+                nspans++;
+            }
             again = sub->global;
         }
         else
@@ -1260,7 +1771,10 @@ struct subst* sub;
                     break;
             }
 
-            str_append(&s_accum, line.active + offset, matched);
+            /* An empty match at the end of the line has no character
+               after it to copy. */
+            if (!splice && offset < line.length)
+                str_append(&s_accum, line.active + offset, matched);
         }
 
         /* Start after the match.  last_end is the real end of the matched
@@ -1268,19 +1782,37 @@ struct subst* sub;
        matched the empty string.  */
         start = offset + matched;
         last_end = regs.end[0];
+
+        /* Matches that are close together are cheaper to copy along
+           with the text between them than to keep track of. */
+        if (splice && !fixed && nspans == DENSE_SPANS
+            && start < DENSE_SPANS * DENSE_SPAN_BYTES)
+        {
+            unsplice_subst_spans(nspans, start);
+            splice = false;
+        }
     } while (again
         && start <= line.length
         && match_regex(sub->regx, line.active, line.length, start,
             &regs, sub->max_id + 1));
 
-    /* Copy stuff to the right of the last match into the output string. */
-    if (start < line.length)
-        str_append(&s_accum, line.active + start, line.length - start);
-    s_accum.chomped = line.chomped;
-
-    /* Exchange line and s_accum.  This can be much cheaper
-       than copying s_accum.active into line.text (for huge lines). */
-    line_exchange(&line, &s_accum, false);
+    if (splice)
+    {
+        if (nspans > 0)
+            apply_subst_spans(nspans, fixed);
+    }
+    else
+    {
+        /* Copy stuff to the right of the last match into the output
+           string. */
+        if (start < line.length)
+            str_append(&s_accum, line.active + start, line.length - start);
+        s_accum.chomped = line.chomped;
+
+        /* Exchange line and s_accum.  This can be much cheaper
+           than copying s_accum.active into line.text (for huge lines). */
+        line_exchange(&line, &s_accum, false);
+    }
 
     /* Finish up. */
     if (count < sub->numb)
@@ -1301,14 +1833,7 @@ post_subst:
 
         if (pipe_fp != NULL)
         {
-            while (!feof(pipe_fp))
-            {
-                char buf[4096];
-                int n = fread(buf, sizeof(char), 4096, pipe_fp);
-                if (n > 0)
-                    str_append(&s_accum, buf, n);
-            }
-
+            str_append_pipe(&s_accum, pipe_fp);
             pclose(pipe_fp);
 
             /* Exchange line and s_accum.  This can be much cheaper than copying
@@ -1402,6 +1927,9 @@ struct input* input;
     {
         if (match_address_p(cur_cmd, input) != cur_cmd->addr_bang)
         {
+            if (hold_pending && !keeps_hold_pending(cur_cmd->cmd))
+                copy_pending_hold(false);
+
             switch (cur_cmd->cmd)
             {
             case 'a':
@@ -1470,16 +1998,16 @@ struct input* input;
 
                 if (pipe_fp != NULL)
                 {
-                    char buf[4096];
-                    int n;
-                    while (!feof(pipe_fp))
-                        if ((n = fread(buf, sizeof(char), 4096, pipe_fp)) > 0)
-                        {
-                            if (!cmd_length)
-                                str_append(&s_accum, buf, n);
-                            else
-                                ck_fwrite(buf, 1, n, output_file.fp);
-                        }
+                    if (!cmd_length)
+                        str_append_pipe(&s_accum, pipe_fp);
+                    else
+                    {
+                        char buf[FREAD_BUFFER_SIZE];
+                        size_t n;
+                        while ((n = fread(buf, sizeof(char),
+                            FREAD_BUFFER_SIZE, pipe_fp)) > 0)
+                            ck_fwrite(buf, 1, n, output_file.fp);
+                    }
 
                     pclose(pipe_fp);
                     if (!cmd_length)
@@ -1528,8 +2056,9 @@ struct input* input;
                 break;
 
             case 'h':
-                /* Here, it is ok to have true.  */
-                line_copy(&line, &hold, true);
+                /* Here, it is ok to have true.  The copy is made when
+                   it is first needed.  */
+                hold_pending = true;
                 break;
 
             case 'H':
@@ -1586,8 +2115,11 @@ struct input* input;
             case 'P':
             {
                 char* p = memchr(line.active, '\n', line.length);
-                output_line(line.active, p ? p - line.active : line.length,
-                    p ? true : line.chomped, &output_file);
+                if (p)
+                    output_first_line(p, &output_file);
+                else
+                    output_line(line.active, line.length, line.chomped,
+                        &output_file);
             }
             break;
 
@@ -1659,8 +2191,11 @@ struct input* input;
                 if (cur_cmd->x.fp)
                 {
                     char* p = memchr(line.active, '\n', line.length);
-                    output_line(line.active, p ? p - line.active : line.length,
-                        p ? true : line.chomped, cur_cmd->x.outf);
+                    if (p)
+                        output_first_line(p, cur_cmd->x.outf);
+                    else
+                        output_line(line.active, line.length, line.chomped,
+                            cur_cmd->x.outf);
                 }
                 break;
 
@@ -1877,6 +2412,7 @@ char** argv;
     FREE(hold.text);
     FREE(line.text);
     FREE(s_accum.text);
+    FREE(subst_spans);
 #endif /*DEBUG_LEAKS*/
 
     if (input.bad_count)
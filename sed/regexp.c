@@ -33,6 +33,9 @@
 
 extern bool use_extended_syntax_p;
 
+/* How many regex searches gave up because of the step limit? */
+countT regex_limit_hits = 0;
+
 static const char errors[] =
 "no previous regular expression\0"
 "cannot specify modifiers on empty regexp";
@@ -249,10 +252,22 @@ int regsize;
 
     regex->pattern.regs_allocated = REGS_REALLOCATE;
 
+    /* When no registers are wanted (addresses), re_search only checks
+       that a match exists and stops at the first accepting state. */
     ret = re_search(&regex->pattern, buf, buflen, buf_start_offset,
         buflen - buf_start_offset,
         regsize ? regarray : NULL);
 
+    /* The search gave up (see --regex-step-limit): the line is
+       treated as not matching.  Other failures (-2) are internal
+       errors and are handled as before. */
+    if (ret == -3 && re_step_limit != 0)
+    {
+        if (regex_limit_hits++ == 0)
+            fprintf(stderr, _("%s: warning: regex step limit exceeded, line not matched\n"),
+                myname);
+    }
+
     return (ret > -1);
 #endif
 }
@@ -150,6 +150,12 @@ Usage: %s [OPTION]... {script-only-if-no-other-script} [input-file]...\n\
                  specify the desired line-wrap length for the 'l' command\n"));
 	fprintf(out, _("  --posix\n\
                  disable all GNU extensions.\n"));
+#ifndef REG_PERL
+	fprintf(out, _("  --regex-step-limit=N\n\
+                 give up a regex search after N steps of back-reference\n\
+                 matching; the line is then not matched (0 means no limit).\n\
+                 Regexps without back-references are not limited\n"));
+#endif
 	fprintf(out, _("  -r, --regexp-extended\n\
                  use extended regular expressions in the script.\n"));
 #ifdef REG_PERL
@@ -198,6 +204,9 @@ char** argv;
 	  {"in-place", 2, NULL, 'i'},
 	  {"copy", 0, NULL, 'c'},
 	  {"line-length", 1, NULL, 'l'},
+#ifndef REG_PERL
+	  {"regex-step-limit", 1, NULL, 'L'},
+#endif
 	  {"quiet", 0, NULL, 'n'},
 	  {"posix", 0, NULL, 'p'},
 	  {"silent", 0, NULL, 'n'},
@@ -302,6 +311,12 @@ char** argv;
 			lcmd_out_line_len = ATOI(optarg);
 			break;
 
+#ifndef REG_PERL
+		case 'L':
+			re_step_limit = ATOI(optarg);
+			break;
+#endif
+
 		case 'p':
 			posixicity = POSIXLY_BASIC;
 			break;
@@ -388,6 +403,10 @@ to the extent permitted by law.\n\
 
 	return_code = process_files(the_program, argv + optind);
 
+	if (regex_limit_hits)
+		fprintf(stderr, _("%s: regex step limit exceeded on %lu searches\n"),
+			myname, CAST(unsigned long)regex_limit_hits);
+
 	finish_program(the_program);
 	ck_fclose(NULL);
 
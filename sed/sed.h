@@ -111,23 +111,36 @@ struct addr {
 };
 
 
+/* One step of a replacement: the literal text 'prefix', followed by
+   the text matched by group 'subst_id' unless it is -1. */
 struct replacement {
   char *prefix;
   size_t prefix_length;
   int subst_id;
   enum replacement_types repl_type;
-  struct replacement *next;
+};
+
+/* The rewrites of a run of s///g commands on distinct single bytes,
+   which the first command of the run makes in one scan. */
+struct byte_subst {
+  char *text[256];	/* what each byte becomes, or NULL to keep it */
+  size_t length[256];
+  unsigned in_place : 1; /* is every rewrite a single byte? */
 };
 
 struct subst {
   struct regex *regx;
-  struct replacement *replacement;
+  struct replacement *replacement; /* the steps, or NULL if there are none */
+  size_t repl_count;	/* number of steps */
+  size_t repl_length;	/* total length of their literal text */
   countT numb;		/* if >0, only substitute for match number "numb" */
   struct output *outf;	/* 'w' option given */
   unsigned global : 1;	/* 'g' option given */
   unsigned print : 2;	/* 'p' option given (before/after eval) */
   unsigned eval : 1;	/* 'e' option given */
   unsigned max_id : 4;  /* maximum backreference on the RHS */
+  unsigned repl_modified : 1; /* does a step convert case? */
+  struct byte_subst *fused; /* the run folded into this command, or NULL */
 };
 
 #ifdef REG_PERL
@@ -242,6 +255,9 @@ extern char *read_mode;
 /* Should we use EREs? */
 extern bool use_extended_syntax_p;
 
+/* How many regex searches gave up because of the step limit? */
+extern countT regex_limit_hits;
+
 /* Declarations for multibyte character sets.  */
 extern int mb_cur_max;
 extern bool is_utf8;